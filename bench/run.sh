@@ -0,0 +1,160 @@
+#!/bin/sh
+#
+# run the benchmark suite and report the results as JSON
+#
+# usage: bench/run.sh [-n iterations] [-w warmups] [-o output] [-c baseline] [-t threshold] [benchmark...]
+#
+#   -n N    timed runs per benchmark (default 5)
+#   -w N    untimed warm-up runs per benchmark (default 1)
+#   -o F    also write the JSON results to file F
+#   -c F    compare against the results saved in F and flag regressions
+#   -t P    percentage by which a median may grow before it is a regression (default 10)
+#
+# Each benchmark is a script in this directory, run with './parse -g -g' so that the
+# exact number of bytes allocated ('nalloc') is reported.  The 'parse' and 'nested'
+# benchmarks are large inputs generated on the fly, so that time spent reading and
+# parsing dominates; their throughput is also reported in MB/s.
+
+cd "$(dirname "$0")/.." || exit 1
+
+PARSE=./parse
+ITERATIONS=5
+WARMUPS=1
+OUTPUT=
+BASELINE=
+THRESHOLD=10
+
+while getopts n:w:o:c:t: opt; do
+    case $opt in
+        n) ITERATIONS=$OPTARG ;;
+        w) WARMUPS=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        c) BASELINE=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        *) sed -n '5,11s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ ! -x $PARSE ]; then
+    echo "$PARSE not found: run 'make' first" >&2
+    exit 1
+fi
+
+TMP=${TMPDIR:-/tmp}/bench.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' 0 1 2 15
+
+# a large input: many small top-level definitions, mostly parsed and only lightly evaluated
+
+awk 'BEGIN {
+    for (i= 0;  i < 4000;  ++i) {
+        printf("var v%d = { name: \"item%d\", value: %d, ratio: %d.5, list: [%d, %d, %d] };\n", i, i, i, i, i, i+1, i+2);
+        printf("fun f%d(a, b) { if (a < b) { a + b * %d } else { var c = a - b; c * c + %d } }\n", i, i, i);
+        printf("// comment line %d\n", i);
+    }
+}' > $TMP/parse.txt
+
+# deeply nested member and index assignments, and parenthesised expressions, which the
+# parser must recognise without re-parsing the operands it has already seen
+
+awk 'function member(d) { return d == 0 ? "m.n" : "m.t[" member(d - 1) "].n" }
+     function paren(d) { return d == 0 ? "m.n" : "(" paren(d - 1) " + 0)" }
+BEGIN {
+    print "m = { n: 0 };  m.t = [m];";
+    for (i= 0;  i < 1000;  ++i) {
+        d= i % 5;
+        printf("m.t[%s].v%d = %s;\n", member(d), i % 10, member(d));
+        printf("m.t[0].t[%s].n += %s;\n", member(d), paren(d * 2));
+    }
+}' > $TMP/nested.txt
+
+if [ $# -eq 0 ]; then
+    set -- calls maps strings closures exceptions quasiquote printing echo gc parse nested
+fi
+
+now() { date +%s%N; }
+
+# run one benchmark once, print "nanoseconds nalloc"
+run() {
+    script=bench/$1.txt
+    [ -r $TMP/$1.txt ] && script=$TMP/$1.txt
+    start=$(now)
+    gc=$($PARSE -g -g $script 2>&1 | tail -n 1)
+    stop=$(now)
+    case "$gc" in
+        "[GC: "*" bytes allocated]") ;;
+        *) echo "$1: benchmark failed: $gc" >&2; return 1 ;;
+    esac
+    gc=${gc#\[GC: }
+    echo $((stop - start)) ${gc%% *}
+}
+
+results=$TMP/results.json
+echo '{' > $results
+echo '  "iterations": '$ITERATIONS',' >> $results
+echo '  "benchmarks": [' >> $results
+sep=
+status=0
+for name in "$@"; do
+    i=0
+    while [ $i -lt $WARMUPS ]; do run $name > /dev/null || break; i=$((i + 1)); done
+    : > $TMP/times
+    i=0
+    while [ $i -lt $ITERATIONS ]; do
+        run $name >> $TMP/times || { status=1; break; }
+        i=$((i + 1))
+    done
+    [ -s $TMP/times ] || continue
+    bytes=0
+    [ -r $TMP/$name.txt ] && bytes=$(wc -c < $TMP/$name.txt)
+    sort -n $TMP/times | awk -v name=$name -v sep="$sep" -v bytes=$bytes '
+        { t[NR]= $1;  nalloc= $2 }
+        END {
+            n= NR;
+            median= (n % 2) ? t[(n + 1) / 2] : (t[n / 2] + t[n / 2 + 1]) / 2;
+            p95= int(0.95 * n);  if (p95 < 0.95 * n) ++p95;
+            throughput= bytes > 0 ? sprintf(", \"mb_per_s\": %.2f", bytes * 1e3 / median) : "";
+            printf("%s    { \"name\": \"%s\", \"median_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"nalloc\": %s%s }",
+                   sep, name, median / 1e6, t[p95] / 1e6, t[1] / 1e6, t[n] / 1e6, nalloc, throughput);
+        }' >> $results
+    sep=",
+"
+done
+echo >> $results
+echo '  ]' >> $results
+echo '}' >> $results
+
+cat $results
+[ -n "$OUTPUT" ] && cp $results "$OUTPUT"
+
+if [ -n "$BASELINE" ]; then
+    if [ ! -r "$BASELINE" ]; then
+        echo "$BASELINE: cannot read baseline" >&2
+        exit 1
+    fi
+    # one benchmark per line: pick out name, median and nalloc from both files
+    awk -v threshold=$THRESHOLD '
+        function field(line, key,    s) {
+            s= line;
+            sub(".*\"" key "\": *", "", s);
+            sub("[,} ].*", "", s);
+            gsub("\"", "", s);
+            return s;
+        }
+        /"name":/ {
+            name= field($0, "name");
+            if (FILENAME == ARGV[1]) { base[name]= field($0, "median_ms");  balloc[name]= field($0, "nalloc");  next }
+            if (!(name in base)) { printf("%-12s %10s ms  (not in baseline)\n", name, field($0, "median_ms"));  next }
+            median= field($0, "median_ms");  nalloc= field($0, "nalloc");
+            change= base[name] > 0 ? 100 * (median - base[name]) / base[name] : 0;
+            flag= change > threshold ? "REGRESSION" : "";
+            if (nalloc > balloc[name]) flag= flag (flag ? ", " : "") "more allocation";
+            printf("%-12s %10.3f ms  %10.3f ms  %+7.1f%%  %12d bytes  %s\n", name, base[name], median, change, nalloc - balloc[name], flag);
+            if (change > threshold) regressions++;
+        }
+        END { exit regressions > 0 }
+    ' "$BASELINE" $results >&2 || status=1
+fi
+
+exit $status
@@ -92,7 +92,13 @@ extern inline TYPE NAME##_append(NAME *b, TYPE value)						\
 												\
 extern inline void NAME##_appendAll(NAME *b, const TYPE *s, size_t len)				\
 {												\
-    while (len--) NAME##_append(b, *s++);							\
+    if (b->position + len > b->capacity) {							\
+	size_t capacity= b->capacity ? b->capacity * 2 : 2;					\
+	while (capacity < b->position + len) capacity *= 2;					\
+	NAME##_grow(b, capacity);								\
+    }												\
+    memcpy(b->contents + b->position, s, sizeof(TYPE) * len);					\
+    b->position += len;										\
 }												\
 												\
 extern inline TYPE *NAME##_buffer(NAME *b)							\
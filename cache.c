@@ -0,0 +1,458 @@
+/* on-disk cache of parsed files, included by parse.leg
+ *
+ * With -c every file read by readEvalPrint() is first looked up in '<file>.cache'.  The
+ * cache holds the AST of each top-level statement in the file, along with the file's size
+ * and modification time and a fingerprint of the syntax macros that were defined when it
+ * was parsed.  If any of these has changed the file is parsed as usual and its cache is
+ * written again.  Files whose parse depends on run-time state (macro expansions, 'import'
+ * statements, case labels that are not literals) are never cached.
+ *
+ * Each object is written as a one-byte tag followed by its contents.  Strings, symbols, typed
+ * arrays and prototypes are numbered in the order they are written, and so are maps (separately, to
+ * keep the numbers of the far more frequent symbols small).  Later occurrences refer back
+ * to that number, so shared structure and the many repetitions of each symbol are written
+ * only once.  Symbols and prototypes are written by name and interned again when the
+ * cache is loaded.
+ */
+
+#if defined(__APPLE__)
+# define st_mtim st_mtimespec
+#endif
+
+#define CACHE_MAGIC     "sandbox AST cache"
+#define CACHE_VERSION   1
+
+enum {
+    CACHE_NULL      = 'n',
+    CACHE_INTEGER   = 'i',  // zigzag-encoded varint
+    CACHE_FLOAT     = 'f',  // the bytes of a flt_t
+    CACHE_BIGINT    = 'b',  // 1 if negative or else 0, varint number of limbs, the bytes of the limbs
+    CACHE_STRING    = 's',  // varint size, bytes
+    CACHE_SYMBOL    = 'y',  // varint length, name, nul
+    CACHE_PROTO     = 'p',  // varint length, name, nul
+    CACHE_MAP       = 'm',  // varint size, key value key value ...
+    CACHE_REFERENCE = 'r',  // varint number of a string, symbol or prototype already read
+    CACHE_MAP_REFERENCE = 'R',  // varint number of a map already read
+    CACHE_TYPED_ARRAY = 'a',    // 'i', 'f' or 'b' for the type, varint size, the bytes of the elements
+};
+
+static char cacheTypedArrayKinds[NTYPES]= { [Int64Array]= 'i', [Float64Array]= 'f', [ByteArray]= 'b' };
+
+typedef struct cacheHeader
+{
+    char     magic[sizeof(CACHE_MAGIC)];
+    uint32_t version;
+    uint32_t floatSize;
+    int64_t  mtime, mtimeNsec, size;    // of the file that was parsed
+    uint64_t syntax;                    // fingerprint of the syntax macros defined at the time
+    uint64_t statements;
+} cacheHeader;
+
+// a parse of the source depends only on the text of the file and the names of the macros
+// defined when it is parsed; this hashes the latter (independently of their order in globals)
+uint64_t syntaxFingerprint(void)
+{
+    uint64_t fingerprint= 0;
+    for (size_t i= 0;  i < map_size(globals);  ++i) {
+        struct Pair *pair= &get(globals, Map, elements)[i];
+        if (!is(Symbol, pair->key) || !is(Function, pair->value)) continue;
+        oop fixed= get(pair->value, Function, fixed);
+        if (!isInteger(fixed)) continue;
+        uint64_t hash= 14695981039346656037ULL ^ getInteger(fixed);     // FNV-1a
+        for (char *s= get(pair->key, Symbol, name);  *s;  ++s) hash= (hash ^ (unsigned char)*s) * 1099511628211ULL;
+        fingerprint += hash;
+    }
+    return fingerprint;
+}
+
+char *cacheFileName(char *fileName)
+{
+    size_t len= strlen(fileName);
+    char *name= malloc(len + sizeof(".cache"));
+    memcpy(name, fileName, len);
+    memcpy(name + len, ".cache", sizeof(".cache"));
+    return name;
+}
+
+typedef struct cacheWriter
+{
+    char         *fileName;
+    cacheHeader   header;
+    StringBuffer  bytes;
+    oop          *objects;      // open-addressed table of the objects written so far
+    size_t       *numbers;      // and the number each was given, times two plus one for maps
+    size_t        capacity, count;
+    size_t        names, maps;  // numbers given so far
+    bool          ok;           // false once something has been parsed that cannot be cached
+    oop           failed;       // the object that could not be written, if any
+    int_t         parseTime;
+} cacheWriter;
+
+void cacheWriterInit(cacheWriter *w)
+{
+    w->bytes= (StringBuffer)BUFFER_INITIALISER;
+    w->capacity= 1024;
+    w->objects= malloc(sizeof(oop) * w->capacity);
+    w->numbers= malloc(sizeof(size_t) * w->capacity);
+    w->count= w->names= w->maps= 0;
+    w->ok= true;
+    w->failed= NULL;
+    w->parseTime= 0;
+}
+
+cacheWriter *cacheWriterNew(char *fileName)
+{
+    struct stat st;
+    if (stat(fileName, &st) || !S_ISREG(st.st_mode)) return NULL;
+    cacheWriter *w= malloc(sizeof(cacheWriter));
+    cacheWriterInit(w);
+    w->fileName= fileName;
+    memcpy(w->header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    w->header.version= CACHE_VERSION;
+    w->header.floatSize= sizeof(flt_t);
+    w->header.mtime= st.st_mtim.tv_sec;
+    w->header.mtimeNsec= st.st_mtim.tv_nsec;
+    w->header.size= st.st_size;
+    w->header.syntax= syntaxFingerprint();
+    w->header.statements= 0;
+    return w;
+}
+
+size_t cacheHash(oop obj, size_t capacity)
+{
+    return ((uintptr_t)obj >> 4) * 0x9E3779B97F4A7C15ULL & (capacity - 1);
+}
+
+// answer the (tagged) number given to obj when it was written, or -1 after numbering it now
+ssize_t cacheNumber(cacheWriter *w, oop obj, bool isMap)
+{
+    size_t i= cacheHash(obj, w->capacity);
+    while (w->objects[i]) {
+        if (w->objects[i] == obj) return w->numbers[i];
+        i= (i + 1) & (w->capacity - 1);
+    }
+    w->objects[i]= obj;
+    w->numbers[i]= isMap ? w->maps++ * 2 + 1 : w->names++ * 2;
+    if (++w->count * 2 > w->capacity) {
+        oop    *objects= w->objects;
+        size_t *numbers= w->numbers;
+        size_t  capacity= w->capacity;
+        w->capacity *= 2;
+        w->objects= malloc(sizeof(oop) * w->capacity);
+        w->numbers= malloc(sizeof(size_t) * w->capacity);
+        for (size_t j= 0;  j < capacity;  ++j) {
+            if (!objects[j]) continue;
+            size_t k= cacheHash(objects[j], w->capacity);
+            while (w->objects[k]) k= (k + 1) & (w->capacity - 1);
+            w->objects[k]= objects[j];
+            w->numbers[k]= numbers[j];
+        }
+    }
+    return -1;
+}
+
+void cacheWriteNumber(cacheWriter *w, uint64_t n)
+{
+    while (n >= 0x80) {
+        StringBuffer_append(&w->bytes, (n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    StringBuffer_append(&w->bytes, n);
+}
+
+void cacheWriteName(cacheWriter *w, int tag, char *name)
+{
+    size_t len= strlen(name);
+    StringBuffer_append(&w->bytes, tag);
+    cacheWriteNumber(w, len);
+    StringBuffer_appendAll(&w->bytes, name, len + 1);
+}
+
+// answer false if obj (or anything it contains) cannot be written
+bool cacheWriteObject(cacheWriter *w, oop obj)
+{
+    switch (getType(obj)) {
+        case Undefined: {
+            StringBuffer_append(&w->bytes, CACHE_NULL);
+            return true;
+        }
+        case Integer: {
+            int_t value= getInteger(obj);
+            StringBuffer_append(&w->bytes, CACHE_INTEGER);
+            cacheWriteNumber(w, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+            return true;
+        }
+        case Float: {
+            flt_t value= get(obj, Float, _value);
+            StringBuffer_append(&w->bytes, CACHE_FLOAT);
+            StringBuffer_appendAll(&w->bytes, (char *)&value, sizeof(value));
+            return true;
+        }
+        case BigInt: {      // immutable, so not numbered
+            StringBuffer_append(&w->bytes, CACHE_BIGINT);
+            StringBuffer_append(&w->bytes, get(obj, BigInt, negative));
+            cacheWriteNumber(w, get(obj, BigInt, size));
+            StringBuffer_appendAll(&w->bytes, (char *)get(obj, BigInt, limbs), sizeof(uint64_t) * get(obj, BigInt, size));
+            return true;
+        }
+        case Function: {
+            w->failed= obj;
+            return false;
+        }
+        default:
+            break;
+    }
+    oop name= is(Map, obj) ? map_get(obj, __name___symbol) : null;
+    bool isProto= is(Symbol, name) && map_get(AST, name) == obj;
+    ssize_t number= cacheNumber(w, obj, is(Map, obj) && !isProto);
+    if (number >= 0) {
+        StringBuffer_append(&w->bytes, (number & 1) ? CACHE_MAP_REFERENCE : CACHE_REFERENCE);
+        cacheWriteNumber(w, number / 2);
+        return true;
+    }
+    switch (getType(obj)) {
+        case String: {
+            StringBuffer_append(&w->bytes, CACHE_STRING);
+            cacheWriteNumber(w, string_size(obj));
+            StringBuffer_appendAll(&w->bytes, get(obj, String, value), string_size(obj));
+            return true;
+        }
+        case Symbol: {
+            cacheWriteName(w, CACHE_SYMBOL, get(obj, Symbol, name));
+            return true;
+        }
+        case Int64Array:
+        case Float64Array:
+        case ByteArray: {
+            size_t size= typedArray_size(obj);
+            StringBuffer_append(&w->bytes, CACHE_TYPED_ARRAY);
+            StringBuffer_append(&w->bytes, cacheTypedArrayKinds[getType(obj)]);
+            cacheWriteNumber(w, size);
+            StringBuffer_appendAll(&w->bytes, typedArray_elements(obj), size * typedArray_elementSize(getType(obj)));
+            return true;
+        }
+        case Map: {
+            if (isProto) {
+                cacheWriteName(w, CACHE_PROTO, get(name, Symbol, name));
+                return true;
+            }
+            StringBuffer_append(&w->bytes, CACHE_MAP);
+            cacheWriteNumber(w, map_size(obj));
+            for (size_t i= 0;  i < map_size(obj);  ++i) {
+                struct Pair *pair= &get(obj, Map, elements)[i];
+                if (!cacheWriteObject(w, pair->key) || !cacheWriteObject(w, pair->value)) return false;
+            }
+            return true;
+        }
+        default:    // Generator, Memo, PersistentMap: state outside the heap that cannot be written
+            break;
+    }
+    w->failed= obj;
+    return false;
+}
+
+// parse the next statement, also writing it to the cache if there is one
+int cacheParse(cacheWriter *w)
+{
+    if (!w) return yyparse(parser->yy);
+    int impure= parser->impureParses;
+    input_t *input= parser->input;
+    int_t start= clockNanoseconds(CLOCK_MONOTONIC);
+    int result= yyparse(parser->yy);
+    w->parseTime += clockNanoseconds(CLOCK_MONOTONIC) - start;
+    if (impure != parser->impureParses || input != parser->input) w->ok= false;
+    if (w->ok && result && parser->result) {
+        w->ok= cacheWriteObject(w, parser->result);
+        w->header.statements++;
+    }
+    return result;
+}
+
+// write header and bytes to a temporary file and rename it to fileName, so that readers
+// never see a partially written file; answer false (with errno set) if that fails
+bool cacheWriteFile(char *fileName, void *header, size_t headerSize, StringBuffer *bytes)
+{
+    char *tempName= malloc(strlen(fileName) + sizeof(".XXXXXX"));
+    strcpy(tempName, fileName);
+    strcat(tempName, ".XXXXXX");
+    int fd= mkstemp(tempName);
+    if (fd < 0) return false;
+    fchmod(fd, 0644);
+    size_t size= StringBuffer_position(bytes);
+    if (write(fd, header, headerSize) != headerSize
+        || write(fd, StringBuffer_buffer(bytes), size) != size
+        || close(fd)
+        || rename(tempName, fileName)) {
+        int error= errno;
+        unlink(tempName);
+        errno= error;
+        return false;
+    }
+    return true;
+}
+
+void cacheSave(cacheWriter *w)
+{
+    if (opt_v) {
+        printf("[cache: %s: parsed %llu statements in %.3f ms%s%s%s]\n", w->fileName, (unsigned long long)w->header.statements,
+               w->parseTime / 1e6, w->ok ? "" : ", not cacheable", w->failed ? ": it contains a " : "",
+               w->failed ? typeName(getType(w->failed)) : "");
+    }
+    if (!w->ok) return;
+    char *cacheName= cacheFileName(w->fileName);
+    if (!cacheWriteFile(cacheName, &w->header, sizeof(w->header), &w->bytes) && opt_v) perror(cacheName);
+}
+
+typedef struct cacheReader
+{
+    unsigned char *position, *limit;
+    OopStack       names, maps;     // indexed by number
+} cacheReader;
+
+bool cacheReadNumber(cacheReader *r, uint64_t *n)
+{
+    *n= 0;
+    for (int shift= 0;  r->position < r->limit && shift < 64;  shift += 7) {
+        unsigned char byte= *r->position++;
+        *n |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+char *cacheReadName(cacheReader *r)
+{
+    uint64_t len;
+    if (!cacheReadNumber(r, &len) || len >= r->limit - r->position || r->position[len]) return NULL;
+    char *name= (char *)r->position;
+    r->position += len + 1;
+    return name;
+}
+
+// answer NULL if the cache is malformed
+oop cacheReadObject(cacheReader *r)
+{
+    if (r->position >= r->limit) return NULL;
+    uint64_t n;
+    switch (*r->position++) {
+        case CACHE_NULL: {
+            return null;
+        }
+        case CACHE_INTEGER: {
+            if (!cacheReadNumber(r, &n)) return NULL;
+            return makeInteger((int_t)(n >> 1) ^ -(int_t)(n & 1));
+        }
+        case CACHE_FLOAT: {
+            flt_t value;
+            if (r->limit - r->position < sizeof(value)) return NULL;
+            memcpy(&value, r->position, sizeof(value));
+            r->position += sizeof(value);
+            return makeFloat(value);
+        }
+        case CACHE_BIGINT: {
+            if (r->position >= r->limit || *r->position > 1) return NULL;
+            bool negative= *r->position++;
+            if (!cacheReadNumber(r, &n) || n > (r->limit - r->position) / sizeof(uint64_t)) return NULL;
+            uint64_t *limbs= bigint_limbs(n);
+            memcpy(limbs, r->position, sizeof(uint64_t) * n);
+            r->position += sizeof(uint64_t) * n;
+            return bigint_make(negative, limbs, n);
+        }
+        case CACHE_REFERENCE: {
+            if (!cacheReadNumber(r, &n) || n >= OopStack_position(&r->names)) return NULL;
+            return OopStack_get(&r->names, n);
+        }
+        case CACHE_MAP_REFERENCE: {
+            if (!cacheReadNumber(r, &n) || n >= OopStack_position(&r->maps)) return NULL;
+            return OopStack_get(&r->maps, n);
+        }
+        case CACHE_STRING: {
+            if (!cacheReadNumber(r, &n) || n > r->limit - r->position) return NULL;
+            char *value= malloc(n + 1);
+            memcpy(value, r->position, n);
+            value[n]= '\0';
+            r->position += n;
+            return OopStack_push(&r->names, makeStringFrom(value, n));
+        }
+        case CACHE_SYMBOL: {
+            char *name= cacheReadName(r);
+            if (!name) return NULL;
+            return OopStack_push(&r->names, intern(name));
+        }
+        case CACHE_TYPED_ARRAY: {
+            if (r->position >= r->limit) return NULL;
+            type_t type= Undefined;
+            for (type_t t= 0;  t < NTYPES;  ++t) if (cacheTypedArrayKinds[t] && cacheTypedArrayKinds[t] == *r->position) type= t;
+            r->position++;
+            if (Undefined == type || !cacheReadNumber(r, &n)) return NULL;
+            size_t elementSize= typedArray_elementSize(type);
+            if (n > (r->limit - r->position) / elementSize) return NULL;
+            oop array= OopStack_push(&r->names, makeTypedArray(type, n));
+            memcpy(typedArray_elements(array), r->position, n * elementSize);
+            r->position += n * elementSize;
+            return array;
+        }
+        case CACHE_PROTO: {
+            char *name= cacheReadName(r);
+            if (!name) return NULL;
+            oop proto= map_get(AST, intern(name));
+            if (!is(Map, proto)) return NULL;
+            return OopStack_push(&r->names, proto);
+        }
+        case CACHE_MAP: {
+            if (!cacheReadNumber(r, &n) || n > r->limit - r->position) return NULL;
+            oop map= OopStack_push(&r->maps, makeMapCapacity(n));
+            while (n--) {
+                oop key= cacheReadObject(r);    if (!key)   return NULL;
+                oop value= cacheReadObject(r);  if (!value) return NULL;
+                map_set(map, key, value);
+            }
+            return map;
+        }
+    }
+    return NULL;
+}
+
+// answer an array of the statements in fileName read from its cache, or null if there is no valid cache
+oop cacheLoad(char *fileName)
+{
+    int_t start= clockNanoseconds(CLOCK_MONOTONIC);
+    struct stat st, cst;
+    if (stat(fileName, &st) || !S_ISREG(st.st_mode)) return null;
+    int fd= open(cacheFileName(fileName), O_RDONLY);
+    if (fd < 0) return null;
+    if (fstat(fd, &cst) || cst.st_size < sizeof(cacheHeader)) {
+        close(fd);
+        return null;
+    }
+    unsigned char *data= mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data) return null;
+
+    oop statements= null;
+    cacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (!memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))
+        && header.version   == CACHE_VERSION
+        && header.floatSize == sizeof(flt_t)
+        && header.mtime     == st.st_mtim.tv_sec
+        && header.mtimeNsec == st.st_mtim.tv_nsec
+        && header.size      == st.st_size
+        && header.syntax    == syntaxFingerprint()) {
+        cacheReader r= { data + sizeof(header), data + cst.st_size, BUFFER_INITIALISER, BUFFER_INITIALISER };
+        statements= makeMapCapacity(header.statements);
+        for (uint64_t i= 0;  i < header.statements;  ++i) {
+            oop statement= cacheReadObject(&r);
+            if (!statement) break;
+            map_append(statements, statement);
+        }
+        if (map_size(statements) != header.statements || r.position != r.limit) statements= null;
+    }
+    munmap(data, cst.st_size);
+
+    if (opt_v && null != statements) {
+        printf("[cache: %s: loaded %zu statements in %.3f ms]\n", fileName, map_size(statements),
+               (clockNanoseconds(CLOCK_MONOTONIC) - start) / 1e6);
+    }
+    return statements;
+}
@@ -0,0 +1,143 @@
+/* client for the warm fork server started with './parse ... --serve SOCKET'
+ *
+ * compile:    make client
+ *
+ * run:        ./client SOCKET [script]
+ *
+ *     Runs script (or the standard input) in a child of the server, with the client's own
+ *     standard input, output and error, and exits with the script's exit status.
+ *
+ *             ./client -n COUNT SOCKET script
+ *             ./client -n COUNT -- command [argument ...] script
+ *
+ *     Runs script COUNT times, discarding its output, and prints the mean, median (p50) and
+ *     99th percentile (p99) latency of a request: through the server in the first form, and by
+ *     starting 'command argument ... script' afresh each time in the second, e.g.:
+ *
+ *             ./client -n 1000 -- ./parse bootstrap.txt test.txt
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+long long nanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000*1000*1000 + ts.tv_nsec;
+}
+
+void fatal(char *message)
+{
+    perror(message);
+    exit(255);
+}
+
+// ask the server listening on socketName to run script (NULL for standard input) with fds as
+// its standard input, output, error and working directory; answer its exit status
+int request(char *socketName, char *script, int fds[4])
+{
+    struct sockaddr_un addr= { .sun_family= AF_UNIX };
+    if (strlen(socketName) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket name too long\n", socketName);
+        exit(255);
+    }
+    strcpy(addr.sun_path, socketName);
+    int sock= socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) fatal(socketName);
+
+    char *name= script ? script : "";
+    union { struct cmsghdr header;  char bytes[CMSG_SPACE(sizeof(int[4]))]; } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov= { name, strlen(name) + 1 };      // never empty, so the descriptors always arrive
+    struct msghdr msg= { .msg_iov= &iov, .msg_iovlen= 1, .msg_control= control.bytes, .msg_controllen= sizeof(control.bytes) };
+    struct cmsghdr *cmsg= CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level= SOL_SOCKET;
+    cmsg->cmsg_type= SCM_RIGHTS;
+    cmsg->cmsg_len= CMSG_LEN(sizeof(int[4]));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int[4]));
+    if (sendmsg(sock, &msg, 0) < 0) fatal(socketName);
+
+    int status;
+    ssize_t size= read(sock, &status, sizeof(status));
+    close(sock);
+    if (size != sizeof(status)) {
+        fprintf(stderr, "%s: no exit status from server\n", socketName);
+        return 255;
+    }
+    return status;
+}
+
+// run argv to completion with standard input, output and error redirected to fds
+int spawn(char **argv, int fds[3])
+{
+    pid_t pid= fork();
+    if (pid < 0) fatal("fork");
+    if (0 == pid) {
+        for (int i= 0;  i < 3;  ++i) dup2(fds[i], i);
+        execvp(argv[0], argv);
+        fatal(argv[0]);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) fatal("waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int compare(const void *a, const void *b)
+{
+    long long x= *(long long *)a, y= *(long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int count= 0;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        count= atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || (count < 1 && (argc > 3 || !strcmp(argv[1], "--"))) || (count > 0 && argc < 3)) {
+        fprintf(stderr, "usage: client SOCKET [script]\n"
+                        "       client -n COUNT SOCKET script\n"
+                        "       client -n COUNT -- command [argument ...] script\n");
+        exit(255);
+    }
+
+    char *script= argc > 2 ? argv[argc - 1] : NULL;
+    int cwd= open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd < 0) fatal(".");
+
+    if (!count) {
+        int fds[4]= { 0, 1, 2, cwd };
+        return request(argv[1], script, fds);
+    }
+
+    int null= open("/dev/null", O_RDWR);
+    if (null < 0) fatal("/dev/null");
+    int fds[4]= { null, null, null, cwd };
+    char **command= !strcmp(argv[1], "--") ? argv + 2 : NULL;
+    long long *samples= malloc(sizeof(long long) * count);
+    int failures= 0;
+    for (int i= 0;  i < count;  ++i) {
+        long long start= nanoseconds();
+        int status= command ? spawn(command, fds) : request(argv[1], script, fds);
+        samples[i]= nanoseconds() - start;
+        failures += (0 != status);
+    }
+    qsort(samples, count, sizeof(long long), compare);
+    long long sum= 0;
+    for (int i= 0;  i < count;  ++i) sum += samples[i];
+    printf("%s: %d requests, mean %.3f ms, p50 %.3f ms, p99 %.3f ms",
+           command ? "cold" : "server", count, sum / 1e6 / count, samples[count / 2] / 1e6, samples[count * 99 / 100] / 1e6);
+    if (failures) printf(", %d failed", failures);
+    printf("\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/* garbage collector options and pause times, included by parse.leg
+ *
+ * '--gc OPTIONS', where OPTIONS is a list separated by commas, configures the collector before
+ * it starts:
+ *
+ *  - incremental collects a little at a time, at allocations, instead of stopping the program for
+ *    a whole collection, and generationally, most collections marking only the objects that
+ *    have been modified (found with the virtual memory's dirty bits) since the last
+ *  - markers=N marks with N threads, if the collector was built with parallel marking
+ *  - divisor=N collects when the heap has grown by about 1/N of its size (3 by default): more
+ *    often, with a smaller heap, as N grows
+ *  - full=N makes every Nth incremental collection a full one
+ *  - pause=MS is the time that the collector aims to stop the program for in incremental mode
+ *  - heap=SIZE is the size of the heap to start with and max=SIZE the largest it may grow to,
+ *    in bytes or with a suffix K, M or G
+ *
+ * Every collection and every time that the program is stopped for one (a pause) are recorded,
+ * from the collector's events: gcStats() answers a map of the number of collections and pauses,
+ * the total, longest, median (p50) and 99th percentile (p99) pause in nanoseconds, over the last
+ * GC_RECENT pauses for the percentiles, the size of the heap and of its free part, and the
+ * histogram of pauses, an array whose element i counts the pauses shorter than 2^i microseconds
+ * (and not shorter than 2^(i-1)).  With -g the interpreter prints them when it exits.
+ *
+ * The collector records them while it holds its lock, from whichever thread is collecting, and
+ * gcStats() and -g read a copy taken while holding the same lock, so that they are consistent
+ * even while other threads allocate.  The percentiles are computed by sorting that copy, on the
+ * stack, so that reporting them allocates nothing from the heap that they describe.
+ */
+
+#define GC_RECENT       4096
+#define GC_BUCKETS      40
+
+struct {
+    bool    incremental;
+    int     markers, divisor, full, pause;
+    size_t  heap, maxHeap;
+} gcOptions;
+
+typedef struct gcCounts
+{
+    size_t  collections, pauses;
+    int_t   total, longest;
+    int_t   start;                              // of the current pause, or 0
+    size_t  histogram[GC_BUCKETS];
+    int_t   recent[GC_RECENT];
+} gcCounts;
+
+gcCounts gcStatistics;
+
+// the size in bytes written in s, or -1
+ssize_t gcSize(char *s)
+{
+    char *end;
+    long long size= strtoll(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K':  size <<= 10;  ++end;  break;
+        case 'm': case 'M':  size <<= 20;  ++end;  break;
+        case 'g': case 'G':  size <<= 30;  ++end;  break;
+    }
+    return end == s || *end || size < 0 ? -1 : size;
+}
+
+// parse the options given with --gc, which must be done before initialise()
+void gcConfigure(char *options)
+{
+    char buffer[strlen(options) + 1], *copy= strcpy(buffer, options), *option;     // nothing can be allocated yet
+    while ((option= strsep(&copy, ","))) {
+        char *value= strchr(option, '=');
+        if (value) *value++= '\0';
+        int n= value ? atoi(value) : 0;
+        if      (!strcmp(option, "incremental"))            gcOptions.incremental= true;
+        else if (!strcmp(option, "markers")  && n > 0)      gcOptions.markers= n;
+        else if (!strcmp(option, "divisor")  && n > 0)      gcOptions.divisor= n;
+        else if (!strcmp(option, "full")     && n > 0)      gcOptions.full= n;
+        else if (!strcmp(option, "pause")    && n > 0)      gcOptions.pause= n;
+        else if (!strcmp(option, "heap")     && value && gcSize(value) > 0)  gcOptions.heap= gcSize(value);
+        else if (!strcmp(option, "max")      && value && gcSize(value) > 0)  gcOptions.maxHeap= gcSize(value);
+        else {
+            fprintf(stderr, "--gc: unknown option or bad value: %s\n", option);
+            exit(EX_USAGE);
+        }
+    }
+}
+
+void gcPause(int_t nanoseconds)
+{
+    ++gcStatistics.pauses;
+    gcStatistics.total += nanoseconds;
+    if (nanoseconds > gcStatistics.longest) gcStatistics.longest= nanoseconds;
+    int bucket= 0;
+    for (int_t us= nanoseconds / 1000;  us && bucket < GC_BUCKETS - 1;  us >>= 1) ++bucket;
+    ++gcStatistics.histogram[bucket];
+    gcStatistics.recent[(gcStatistics.pauses - 1) % GC_RECENT]= nanoseconds;
+}
+
+#if (USE_GC)
+
+// called by the collector, which is holding its lock, so it must not allocate
+void gcEvent(GC_EventType event)
+{
+    switch (event) {
+#if (USE_THREADS)
+        case GC_EVENT_PRE_STOP_WORLD:
+#else
+        case GC_EVENT_MARK_START:               // the world is stopped only while marking
+#endif
+            gcStatistics.start= clockNanoseconds(CLOCK_MONOTONIC);
+            break;
+#if (USE_THREADS)
+        case GC_EVENT_POST_START_WORLD:
+#else
+        case GC_EVENT_MARK_END:
+#endif
+            if (gcStatistics.start) gcPause(clockNanoseconds(CLOCK_MONOTONIC) - gcStatistics.start);
+            gcStatistics.start= 0;
+            break;
+        case GC_EVENT_END:
+            ++gcStatistics.collections;
+            break;
+        default:
+            break;
+    }
+}
+
+// apply the options, before and after initialising the collector
+void gcStart(void)
+{
+    if (gcOptions.markers) GC_set_markers_count(gcOptions.markers);
+    GC_INIT();
+    GC_set_on_collection_event(gcEvent);
+    if (gcOptions.divisor)     GC_set_free_space_divisor(gcOptions.divisor);
+    if (gcOptions.full)        GC_set_full_freq(gcOptions.full);
+    if (gcOptions.pause)       GC_set_time_limit(gcOptions.pause);
+    if (gcOptions.maxHeap)     GC_set_max_heap_size(gcOptions.maxHeap);
+    if (gcOptions.heap)        GC_expand_hp(gcOptions.heap);
+    if (gcOptions.incremental) GC_enable_incremental();
+}
+
+#endif
+
+size_t gcHeapSize(void)
+{
+#if (USE_GC)
+    return GC_get_heap_size();
+#else
+    return 0;
+#endif
+}
+
+size_t gcFreeBytes(void)
+{
+#if (USE_GC)
+    return GC_get_free_bytes();
+#else
+    return 0;
+#endif
+}
+
+#if (USE_GC)
+void *gcCopy(void *copy)
+{
+    memcpy(copy, &gcStatistics, sizeof(gcStatistics));
+    return NULL;
+}
+#endif
+
+// copy the statistics into s, sorting its recent pauses
+void gcSnapshot(gcCounts *s)
+{
+#if (USE_GC)
+    GC_call_with_alloc_lock(gcCopy, s);
+#else
+    *s= gcStatistics;
+#endif
+    size_t n= s->pauses < GC_RECENT ? s->pauses : GC_RECENT;
+    qsort(s->recent, n, sizeof(int_t), int_t_compare);
+}
+
+// the pth percentile of the recent pauses of a snapshot
+int_t gcPercentile(gcCounts *s, int p)
+{
+    size_t n= s->pauses < GC_RECENT ? s->pauses : GC_RECENT;
+    return n ? s->recent[(n - 1) * p / 100] : 0;
+}
+
+// the number of buckets of the histogram up to the last that is not empty
+int gcBuckets(gcCounts *s)
+{
+    int n= GC_BUCKETS;
+    while (n && !s->histogram[n - 1]) --n;
+    return n;
+}
+
+void gcPrintStatistics(void)
+{
+    gcCounts s;
+    gcSnapshot(&s);
+    printf("[GC: %zu collections, %zu pauses, total %.3f ms, longest %.3f ms, p50 %.3f ms, p99 %.3f ms, heap %zu kB]\n",
+           s.collections, s.pauses, s.total / 1e6, s.longest / 1e6,
+           gcPercentile(&s, 50) / 1e6, gcPercentile(&s, 99) / 1e6, gcHeapSize() / 1024);
+    for (int i= 0, n= gcBuckets(&s);  i < n;  ++i)
+        printf("[GC: pauses < %9lld us: %zu]\n", 1LL << i, s.histogram[i]);
+}
+
+oop prim_gcStats(oop scope, oop params)
+{
+    gcCounts s;
+    gcSnapshot(&s);
+    int n= gcBuckets(&s);
+    oop histogram= makeMapCapacity(n);
+    for (int i= 0;  i < n;  ++i) map_append(histogram, makeInteger(s.histogram[i]));
+    oop result= makeMap();
+    map_set(result, intern("collections"), makeInteger(s.collections));
+    map_set(result, intern("pauses"     ), makeInteger(s.pauses));
+    map_set(result, intern("total"      ), makeInteger(s.total));
+    map_set(result, intern("longest"    ), makeInteger(s.longest));
+    map_set(result, intern("p50"        ), makeInteger(gcPercentile(&s, 50)));
+    map_set(result, intern("p99"        ), makeInteger(gcPercentile(&s, 99)));
+    map_set(result, intern("heapSize"   ), makeInteger(gcHeapSize()));
+    map_set(result, intern("freeBytes"  ), makeInteger(gcFreeBytes()));
+    map_set(result, intern("histogram"  ), histogram);
+    return result;
+}
@@ -0,0 +1,114 @@
+/* evaluations per second through the embedding API versus starting the interpreter afresh
+ *
+ * compile:    make embedbench
+ *
+ * run:        ./embedbench [-n COUNT] [prelude ...] script
+ *
+ *     Preloads the preludes into a sandbox (see sandbox.h) and then evaluates script COUNT
+ *     times (default 1000), resetting the sandbox after each evaluation; then runs
+ *     './parse prelude ... script' COUNT times.  The script's output is discarded.  Prints
+ *     the mean, median (p50) and 99th percentile (p99) latency and the evaluations per second
+ *     of both, e.g.:
+ *
+ *             ./embedbench -n 1000 bootstrap.txt test.txt
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sandbox.h"
+
+long long nanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000*1000*1000 + ts.tv_nsec;
+}
+
+void fatal(char *message)
+{
+    perror(message);
+    exit(255);
+}
+
+int compare(const void *a, const void *b)
+{
+    long long x= *(long long *)a, y= *(long long *)b;
+    return (x > y) - (x < y);
+}
+
+void report(char *name, long long *samples, int count, int failures)
+{
+    qsort(samples, count, sizeof(long long), compare);
+    long long sum= 0;
+    for (int i= 0;  i < count;  ++i) sum += samples[i];
+    fprintf(stderr, "%s: %d evaluations, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, %.0f per second",
+            name, count, sum / 1e6 / count, samples[count / 2] / 1e6, samples[count * 99 / 100] / 1e6, count / (sum / 1e9));
+    if (failures) fprintf(stderr, ", %d failed", failures);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int count= 1000;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        count= atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || count < 1) {
+        fprintf(stderr, "usage: embedbench [-n COUNT] [prelude ...] script\n");
+        exit(255);
+    }
+    char *script= argv[argc - 1];
+    long long *samples= malloc(sizeof(long long) * count);
+
+    // scripts print to stdout, which is discarded; the results go to stderr
+    int null= open("/dev/null", O_WRONLY);
+    if (null < 0) fatal("/dev/null");
+    fflush(stdout);
+    dup2(null, 1);
+
+    sandbox *sb= sandbox_new();
+    for (int i= 1;  i < argc - 1;  ++i) {
+        if (sandbox_preload(sb, argv[i])) {
+            fprintf(stderr, "%s: %s\n", argv[i], sandbox_error(sb));
+            exit(1);
+        }
+    }
+    int failures= 0;
+    for (int i= 0;  i < count;  ++i) {
+        long long start= nanoseconds();
+        failures += (0 != sandbox_evalFile(sb, script));
+        sandbox_reset(sb);
+        fflush(stdout);
+        samples[i]= nanoseconds() - start;
+    }
+    if (failures) fprintf(stderr, "%s: %s\n", script, sandbox_error(sb));
+    report("api", samples, count, failures);
+
+    char **command= malloc(sizeof(char *) * (argc + 1));
+    command[0]= "./parse";
+    for (int i= 1;  i <= argc;  ++i) command[i]= argv[i];
+    failures= 0;
+    for (int i= 0;  i < count;  ++i) {
+        long long start= nanoseconds();
+        pid_t pid= fork();
+        if (pid < 0) fatal("fork");
+        if (0 == pid) {
+            execv(command[0], command);
+            fatal(command[0]);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0) fatal("waitpid");
+        samples[i]= nanoseconds() - start;
+        failures += !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    report("spawn", samples, count, failures);
+    return 0;
+}
@@ -0,0 +1,309 @@
+/* file primitives, included by parse.leg
+ *
+ *  - readFile(path) answers the contents of a file as a String whose characters are the file
+ *    itself, mapped into memory (copy-on-write) instead of copied, and unmapped when the
+ *    String is collected
+ *  - writeFile(path, data) replaces the contents of a file with a String or an array of
+ *    Strings, written all together by writev(), and answers the number of bytes written
+ *  - openFile(path, mode) opens a file for reading ("r", the default), writing ("w") or
+ *    appending ("a") and answers its descriptor, an integer; readLine(fd) answers its next
+ *    line without the newline, or null at the end of the file; write(fd, data) writes a String
+ *    or an array of Strings; closeFile(fd) closes it
+ *  - removeFile(path) removes a file
+ *
+ * Reading and writing through a descriptor go through a buffer of FILE_BUFFER_SIZE bytes
+ * (larger if a line is longer than that), so that most calls of readLine() and write() cost
+ * no system call at all; Strings larger than the buffer are written directly from where they
+ * are.  What is left in the buffers of descriptors that have not been closed is written when
+ * the program exits.  Writes to the standard output and error, which print() also uses, are
+ * not buffered.
+ *
+ * A mapped String is only kept alive by references to the String itself (slices of it included),
+ * not by pointers into its characters.
+ */
+
+#include <sys/uio.h>
+
+#define FILE_BUFFER_SIZE    (1024 * 1024)
+
+#ifndef IOV_MAX
+# define IOV_MAX            1024    // the least that Linux and the BSDs accept in one writev()
+#endif
+
+typedef struct fileBuffer
+{
+    char   *bytes;
+    size_t  capacity;
+    size_t  start, end;     // what has been read and not yet answered, or written and not yet flushed
+    bool    writing;
+    bool    eof;
+} fileBuffer;
+
+fileBuffer **fileBuffers= NULL;     // indexed by file descriptor
+int          fileCapacity= 0;
+
+// bytes that the collector need not scan
+char *fileBytes(size_t size)
+{
+#if (USE_GC)
+    return GC_malloc_atomic(size);
+#else
+    return memcheck(calloc(1, size));
+#endif
+}
+
+int fileDescriptor(oop params, char *name)
+{
+    oop fd= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!isInteger(fd) || getInteger(fd) < 0) runtimeError("%s: first argument must be a file descriptor", name);
+    return getInteger(fd);
+}
+
+void fileFlushAll(void);
+
+fileBuffer *fileBufferOf(int fd, bool writing)
+{
+    if (fd >= fileCapacity) {
+        int capacity= fileCapacity ? fileCapacity : 64;
+        while (capacity <= fd) capacity *= 2;
+        fileBuffer **buffers= malloc(sizeof(fileBuffer *) * capacity);
+        if (fileCapacity) memcpy(buffers, fileBuffers, sizeof(fileBuffer *) * fileCapacity);
+        fileBuffers= buffers;
+        fileCapacity= capacity;
+    }
+    fileBuffer *b= fileBuffers[fd];
+    if (!b) {
+        static bool registered= false;
+        if (writing && !registered) registered= !atexit(fileFlushAll);
+        b= fileBuffers[fd]= malloc(sizeof(fileBuffer));
+        b->capacity= FILE_BUFFER_SIZE;
+        b->bytes= fileBytes(b->capacity);
+        b->writing= writing;
+    }
+    return b;
+}
+
+// write all of count iovecs to fd, answering false (with errno set) if that fails
+bool fileWritev(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t n= writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            return false;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base= (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool fileFlush(int fd, fileBuffer *b)
+{
+    if (!b->writing || b->start == b->end) return true;
+    struct iovec iov= { b->bytes + b->start, b->end - b->start };
+    b->start= b->end= 0;
+    return fileWritev(fd, &iov, 1);
+}
+
+void fileFlushAll(void)
+{
+    for (int fd= 0;  fd < fileCapacity;  ++fd)
+        if (fileBuffers[fd]) fileFlush(fd, fileBuffers[fd]);
+}
+
+// the size of the mapping for a file of size bytes
+size_t fileMapping(size_t size)
+{
+    return (size + 1 + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+}
+
+#if (USE_GC)
+// data is where the file was mapped, as the String's characters move if it is modified while sliced
+void fileUnmap(void *obj, void *data)
+{
+    munmap(data, fileMapping(string_size((oop)obj)));
+}
+#endif
+
+oop prim_readFile(oop scope, oop params)
+{
+    oop path= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(String, path)) runtimeError("readFile: argument must be a file name");
+    char *name= string_value(path);
+    int fd= open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) runtimeError("readFile: %s: %s", name, strerror(errno));
+    if (0 == st.st_size) {
+        close(fd);
+        return makeString("");
+    }
+    // the file is mapped over the start of a larger anonymous (zeroed) mapping, which leaves a
+    // nul after its last character even when its size is a multiple of the page size
+    size_t size= st.st_size, mapped= fileMapping(size);
+    char *bytes= mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == bytes
+        || MAP_FAILED == mmap(bytes, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+        int error= errno;
+        if (MAP_FAILED != bytes) munmap(bytes, mapped);
+        close(fd);
+        runtimeError("readFile: %s: %s", name, strerror(error));
+    }
+    close(fd);
+    oop string= makeStringFrom(bytes, size);
+#if (USE_GC)
+    GC_register_finalizer(string, fileUnmap, bytes, NULL, NULL);
+#endif
+    return string;
+}
+
+// fill an iovec for each String in data, a String or an array of them
+struct iovec *fileVector(oop data, int *count, char *name)
+{
+    if (is(String, data)) {
+        struct iovec *iov= malloc(sizeof(struct iovec));
+        iov->iov_base= get(data, String, value);
+        iov->iov_len= string_size(data);
+        *count= 1;
+        return iov;
+    }
+    if (!is(Map, data) || !map_isArray(data)) runtimeError("%s: data must be a string or an array of strings", name);
+    size_t size= map_size(data);
+    struct iovec *iov= malloc(sizeof(struct iovec) * (size ? size : 1));
+    for (size_t i= 0;  i < size;  ++i) {
+        oop element= get(data, Map, elements)[i].value;
+        if (!is(String, element)) runtimeError("%s: data must be a string or an array of strings", name);
+        iov[i].iov_base= get(element, String, value);
+        iov[i].iov_len= string_size(element);
+    }
+    *count= size;
+    return iov;
+}
+
+oop prim_writeFile(oop scope, oop params)
+{
+    oop path= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    oop data= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    if (!is(String, path)) runtimeError("writeFile: first argument must be a file name");
+    int count;
+    struct iovec *iov= fileVector(data, &count, "writeFile");
+    size_t total= 0;
+    for (int i= 0;  i < count;  ++i) total += iov[i].iov_len;
+    int fd= open(string_value(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 || !fileWritev(fd, iov, count)) runtimeError("writeFile: %s: %s", string_value(path), strerror(errno));
+    close(fd);
+    return makeInteger(total);
+}
+
+oop prim_openFile(oop scope, oop params)
+{
+    oop path= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    oop mode= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    if (!is(String, path)) runtimeError("openFile: first argument must be a file name");
+    int flags= O_RDONLY;
+    if (is(String, mode)) {
+        if      (!strcmp(string_value(mode), "w")) flags= O_WRONLY | O_CREAT | O_TRUNC;
+        else if (!strcmp(string_value(mode), "a")) flags= O_WRONLY | O_CREAT | O_APPEND;
+        else if ( strcmp(string_value(mode), "r")) runtimeError("openFile: mode must be \"r\", \"w\" or \"a\"");
+    }
+    int fd= open(string_value(path), flags | O_CLOEXEC, 0666);
+    if (fd < 0) runtimeError("openFile: %s: %s", string_value(path), strerror(errno));
+    if (fd < fileCapacity && fileBuffers[fd]) fileBuffers[fd]= NULL;    // left over from a descriptor closed by someone else
+    fileBufferOf(fd, O_RDONLY != flags);
+    return makeInteger(fd);
+}
+
+oop prim_readLine(oop scope, oop params)
+{
+    int fd= fileDescriptor(params, "readLine");
+    fileBuffer *b= fileBufferOf(fd, false);
+    if (b->writing) runtimeError("readLine: %d: not open for reading", fd);
+    size_t scanned= b->start;
+    for (;;) {
+        char *newline= memchr(b->bytes + scanned, '\n', b->end - scanned);
+        if (newline || (b->eof && b->start < b->end)) {
+            char *line= b->bytes + b->start;
+            size_t length= (newline ? newline : b->bytes + b->end) - line;
+            char *value= malloc(length + 1);
+            memcpy(value, line, length);
+            value[length]= '\0';
+            b->start += length + (newline != NULL);
+            return makeStringFrom(value, length);
+        }
+        if (b->eof) return null;
+        // move what is left of the line to the start of the buffer, enlarged if it is full
+        scanned= b->end - b->start;
+        if (scanned == b->capacity) {
+            char *bytes= fileBytes(b->capacity * 2);
+            memcpy(bytes, b->bytes + b->start, scanned);
+            b->bytes= bytes;
+            b->capacity *= 2;
+        }
+        else memmove(b->bytes, b->bytes + b->start, scanned);
+        b->start= 0;
+        b->end= scanned;
+        ssize_t n= read(fd, b->bytes + b->end, b->capacity - b->end);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            runtimeError("readLine: %d: %s", fd, strerror(errno));
+        }
+        if (0 == n) b->eof= true;
+        b->end += n;
+    }
+}
+
+oop prim_write(oop scope, oop params)
+{
+    int fd= fileDescriptor(params, "write");
+    oop data= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    int count;
+    struct iovec *iov= fileVector(data, &count, "write");
+    size_t total= 0;
+    for (int i= 0;  i < count;  ++i) total += iov[i].iov_len;
+    if (fd <= 2) {      // shared with print()
+        fflush(stdout);
+        if (!fileWritev(fd, iov, count)) runtimeError("write: %d: %s", fd, strerror(errno));
+        return makeInteger(total);
+    }
+    fileBuffer *b= fileBufferOf(fd, true);
+    if (!b->writing) runtimeError("write: %d: not open for writing", fd);
+    if (b->end + total > b->capacity) {
+        if (!fileFlush(fd, b)) runtimeError("write: %d: %s", fd, strerror(errno));
+        if (total > b->capacity) {
+            if (!fileWritev(fd, iov, count)) runtimeError("write: %d: %s", fd, strerror(errno));
+            return makeInteger(total);
+        }
+    }
+    for (int i= 0;  i < count;  ++i) {
+        memcpy(b->bytes + b->end, iov[i].iov_base, iov[i].iov_len);
+        b->end += iov[i].iov_len;
+    }
+    return makeInteger(total);
+}
+
+oop prim_closeFile(oop scope, oop params)
+{
+    int fd= fileDescriptor(params, "closeFile");
+    bool flushed= true;
+    if (fd < fileCapacity && fileBuffers[fd]) {
+        flushed= fileFlush(fd, fileBuffers[fd]);
+        fileBuffers[fd]= NULL;
+    }
+    if (close(fd) || !flushed) runtimeError("closeFile: %d: %s", fd, strerror(errno));
+    return null;
+}
+
+oop prim_removeFile(oop scope, oop params)
+{
+    oop path= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(String, path)) runtimeError("removeFile: argument must be a file name");
+    if (unlink(string_value(path))) runtimeError("removeFile: %s: %s", string_value(path), strerror(errno));
+    return null;
+}
@@ -0,0 +1,350 @@
+/* generators, included by parse.leg
+ *
+ * A generator answers its values one at a time, when asked for the next one: 'for (x in gen)'
+ * and next(gen, default) ask for them, so a sequence can be iterated without ever building
+ * the whole of it.  The primitives that make one are:
+ *
+ *  - range(a, b, step) for the integers from a (included) to b (excluded), step apart
+ *  - eachKey(map) and eachValue(map) for what keys() and values() would answer
+ *  - lines(fileName) for the lines of a file, without their newlines
+ *  - generator(fn, args...) for the values passed to 'yield' by fn(args...)
+ *
+ * The last is a coroutine.  The collector cannot scan a stack that the program switches to
+ * by hand (with swapcontext(), for example), so each coroutine runs fn on a thread of its own
+ * instead, and hands the turn back and forth with the thread that asked for the next value:
+ * only one of them runs at any time, and the coroutine borrows the asking thread's mapOwner
+ * and parser while it does.  fn starts running when the first value is asked for and stops at
+ * each 'yield', which is a runtime error outside of a coroutine.  An exception thrown by fn is
+ * thrown again by whoever asked for the value, after which the generator has no more values.
+ * 'yield' answers null when resumed by next(), or the value given to generatorSend() (by the
+ * event loop in io.c, for example).
+ *
+ * The thread of a coroutine that is dropped before it has finished ends when the collector
+ * finds that its generator is no longer used, without running the 'finally' blocks that fn
+ * was in.  A file is closed once all of its lines have been read, or otherwise when its
+ * generator is collected.
+ */
+
+typedef struct rangeState
+{
+    int_t next, stop, step;
+} rangeState;
+
+oop rangeNext(oop gen)
+{
+    rangeState *r= get(gen, Generator, state);
+    if (r->step > 0 ? r->next >= r->stop : r->next <= r->stop) return NULL;
+    oop value= makeInteger(r->next);
+    r->next += r->step;
+    return value;
+}
+
+oop prim_range(oop scope, oop params)
+{
+    size_t argc= map_size(params);
+    for (size_t i= 0;  i < argc;  ++i)
+        if (!map_hasIntegerKey(params, i) || !isInteger(get(params, Map, elements)[i].value))
+            runtimeError("range: arguments must be integers");
+    if (argc < 1 || argc > 3) runtimeError("range: expected 1 to 3 arguments");
+    rangeState *r= malloc(sizeof(rangeState));
+    r->next= argc > 1 ? getInteger(get(params, Map, elements)[0].value) : 0;
+    r->stop= getInteger(get(params, Map, elements)[argc > 1 ? 1 : 0].value);
+    r->step= argc > 2 ? getInteger(get(params, Map, elements)[2].value) : 1;
+    if (!r->step) runtimeError("range: step must not be zero");
+    return makeGenerator(rangeNext, r);
+}
+
+typedef struct mapState
+{
+    oop    map;
+    size_t index;
+} mapState;
+
+// answer the next visible pair of the map, allowing for it to have shrunk since the last one
+struct Pair *mapNextPair(mapState *m)
+{
+    while (m->index < map_size(m->map)) {
+        struct Pair *pair= &get(m->map, Map, elements)[m->index++];
+        if (!isHidden(pair->key)) return pair;
+    }
+    return NULL;
+}
+
+oop eachKeyNext(oop gen)
+{
+    struct Pair *pair= mapNextPair(get(gen, Generator, state));
+    return pair ? pair->key : NULL;
+}
+
+oop eachValueNext(oop gen)
+{
+    struct Pair *pair= mapNextPair(get(gen, Generator, state));
+    return pair ? pair->value : NULL;
+}
+
+oop makeMapGenerator(oop params, char *name, generator_t next)
+{
+    oop map= null;      if (map_hasIntegerKey(params, 0)) map= get(params, Map, elements)[0].value;
+    if (!is(Map, map)) runtimeError("%s: argument must be a map", name);
+    mapState *m= malloc(sizeof(mapState));
+    m->map= map;
+    m->index= 0;
+    return makeGenerator(next, m);
+}
+
+oop prim_eachKey(oop scope, oop params)
+{
+    return makeMapGenerator(params, "eachKey", eachKeyNext);
+}
+
+oop prim_eachValue(oop scope, oop params)
+{
+    return makeMapGenerator(params, "eachValue", eachValueNext);
+}
+
+typedef struct linesState
+{
+    FILE   *file;       // NULL once closed
+    char   *line;       // allocated by getline()
+    size_t  capacity;
+} linesState;
+
+void linesClose(linesState *l)
+{
+    if (!l->file) return;
+    fclose(l->file);
+    free(l->line);      // not ours, so not collected
+    l->file= NULL;
+    l->line= NULL;
+}
+
+#if (USE_GC)
+void linesFinalise(void *obj, void *data)
+{
+    linesClose(get((oop)obj, Generator, state));
+}
+#endif
+
+oop linesNext(oop gen)
+{
+    linesState *l= get(gen, Generator, state);
+    if (!l->file) return NULL;
+    ssize_t length= getline(&l->line, &l->capacity, l->file);
+    if (length < 0) {
+        linesClose(l);
+        return NULL;
+    }
+    if (length && '\n' == l->line[length - 1]) --length;
+    char *value= malloc(length + 1);
+    memcpy(value, l->line, length);
+    value[length]= '\0';
+    return makeStringFrom(value, length);
+}
+
+oop prim_lines(oop scope, oop params)
+{
+    oop name= null;     if (map_hasIntegerKey(params, 0)) name= get(params, Map, elements)[0].value;
+    if (!is(String, name)) runtimeError("lines: argument must be a file name");
+    linesState *l= malloc(sizeof(linesState));
+    l->file= fopen(string_value(name), "r");
+    if (!l->file) runtimeError("lines: %s: %s", string_value(name), strerror(errno));
+    l->line= NULL;
+    l->capacity= 0;
+    oop gen= makeGenerator(linesNext, l);
+#if (USE_GC)
+    GC_register_finalizer(gen, linesFinalise, NULL, NULL, NULL);
+#endif
+    return gen;
+}
+
+#if (USE_THREADS)
+
+typedef struct coroutine
+{
+    oop                 scope, func, args, ast;
+    pthread_mutex_t     lock;
+    pthread_cond_t      turn;           // signalled whenever running changes
+    bool                started, running, finished, closing;
+    oop                 value;          // the value last yielded, NULL when finished
+    oop                 sent;           // the value to be answered by 'yield' when resumed
+    oop                 exception;      // thrown by func, or NULL
+    bool                embedded;       // recover from runtime errors in func
+    char               *error;          // the message of the runtime error that ended func, if any
+    int                 errorStatus;
+    unsigned            owner;          // the mapOwner and parser of the thread asking for a value
+    parser_t           *callerParser;
+    unsigned long long  nalloc, nallocs;    // allocated by the coroutine since it last had the turn
+    sigjmp_buf          closed;         // where the coroutine goes when its generator is collected
+} coroutine;
+
+THREAD_LOCAL coroutine *currentCoroutine= NULL;
+
+// give the turn back to the thread that asked for a value, answering false if the coroutine must end
+bool coroutineSuspend(coroutine *co, oop value)
+{
+    co->nalloc= nalloc;
+    co->nallocs= nallocs;
+    nalloc= nallocs= 0;
+    pthread_mutex_lock(&co->lock);
+    co->value= value;
+    co->running= false;
+    pthread_cond_broadcast(&co->turn);
+    if (value) while (!co->running) pthread_cond_wait(&co->turn, &co->lock);
+    bool closing= co->closing;
+    pthread_mutex_unlock(&co->lock);
+    mapOwner= co->owner;
+    parser= co->callerParser;
+    return value && !closing;
+}
+
+void *coroutineRun(void *arg)
+{
+    coroutine *co= arg;
+    registerThreadLocals();
+    currentCoroutine= co;
+    mapOwner= co->owner;
+    parser= co->callerParser;
+    if (0 == sigsetjmp(co->closed, 0)) {
+        sigjmp_buf recovery;
+        if (!co->embedded || 0 == sigsetjmp(recovery, 0)) {
+            if (co->embedded) errorRecovery= &recovery;
+            jbRecPush();
+            if (0 == sigsetjmp(jbs->jb, 0))
+                apply(co->scope, globals, co->func, co->args, co->ast);
+            else    // only an exception can get here, as apply() deals with everything else
+                co->exception= jbs->result;
+            jbRecPop();
+        }
+        else {
+            co->error= strdup(errorMessage);
+            co->errorStatus= errorStatus;
+        }
+    }
+    co->finished= true;
+    coroutineSuspend(co, NULL);
+    unregisterThreadLocals();
+    return NULL;
+}
+
+// answer the next value yielded by the coroutine, or NULL once it has returned
+oop coroutineNext(oop gen)
+{
+    coroutine *co= get(gen, Generator, state);
+    if (co->finished) return NULL;
+    if (co->running) runtimeError("generator already running");
+    co->owner= mapOwner;
+    co->callerParser= parser;
+    pthread_mutex_lock(&co->lock);
+    co->running= true;
+    if (co->started) pthread_cond_broadcast(&co->turn);
+    else {
+        pthread_t thread;
+        co->embedded= (NULL != errorRecovery);
+        if (pthread_create(&thread, NULL, coroutineRun, co)) {
+            co->running= false;
+            pthread_mutex_unlock(&co->lock);
+            runtimeError("generator: cannot create thread: %s", strerror(errno));
+        }
+        pthread_detach(thread);
+        co->started= true;
+    }
+    while (co->running) pthread_cond_wait(&co->turn, &co->lock);
+    pthread_mutex_unlock(&co->lock);
+    nalloc  += co->nalloc;
+    nallocs += co->nallocs;
+    if (co->error) {
+        strcpy(errorMessage, co->error);
+        recoverFromError(co->errorStatus);
+    }
+    if (co->exception) {
+        oop exception= co->exception;
+        co->exception= NULL;
+        jbs->result= exception;
+        siglongjmp(jbs->jb, j_throw);
+    }
+    return co->value;
+}
+
+#if (USE_GC)
+// the generator is no longer used, so wake its thread up one last time to end it
+void coroutineFinalise(void *obj, void *data)
+{
+    coroutine *co= get((oop)obj, Generator, state);
+    pthread_mutex_lock(&co->lock);
+    if (co->started && !co->finished) {
+        co->closing= true;
+        co->running= true;
+        pthread_cond_broadcast(&co->turn);
+    }
+    pthread_mutex_unlock(&co->lock);
+}
+#endif
+
+#endif // USE_THREADS
+
+oop generatorYield(oop value)
+{
+#if (USE_THREADS)
+    coroutine *co= currentCoroutine;
+    if (co) {
+        if (!coroutineSuspend(co, value)) siglongjmp(co->closed, 1);
+        oop sent= co->sent;
+        co->sent= null;
+        return sent;
+    }
+#endif
+    runtimeError("yield outside of a generator");
+    return null;
+}
+
+// resume gen with value as the answer of the 'yield' at which it stopped, first running it up to
+// its first 'yield' if it has not started yet; other generators ignore value
+oop generatorSend(oop gen, oop value)
+{
+#if (USE_THREADS)
+    if (coroutineNext == get(gen, Generator, next)) {
+        coroutine *co= get(gen, Generator, state);
+        if (!co->started && !generator_next(gen)) return NULL;
+        co->sent= value;
+    }
+#endif
+    return generator_next(gen);
+}
+
+oop prim_generator(oop scope, oop params)
+{
+    oop func= null;     if (map_hasIntegerKey(params, 0)) func= get(params, Map, elements)[0].value;
+    if (!is(Function, func)) runtimeError("generator: first argument must be a function");
+#if (USE_THREADS)
+    oop args= makeMap();
+    for (size_t i= 1;  i < map_size(params);  ++i) map_append(args, get(params, Map, elements)[i].value);
+    coroutine *co= malloc(sizeof(coroutine));     // zeroed, so not yet started
+    co->scope= scope;
+    co->func= func;
+    co->args= args;
+    co->ast= mrAST;
+    pthread_mutex_init(&co->lock, NULL);
+    pthread_cond_init(&co->turn, NULL);
+    co->value= null;
+    co->sent= null;
+    co->exception= NULL;
+    co->error= NULL;
+    oop gen= makeGenerator(coroutineNext, co);
+# if (USE_GC)
+    GC_register_finalizer(gen, coroutineFinalise, NULL, NULL, NULL);
+# endif
+    return gen;
+#else
+    runtimeError("generator: coroutines need threads");
+    return null;
+#endif
+}
+
+oop prim_next(oop scope, oop params)
+{
+    oop gen= null;      if (map_hasIntegerKey(params, 0)) gen= get(params, Map, elements)[0].value;
+    if (!is(Generator, gen)) runtimeError("next: first argument must be a generator");
+    oop value= generator_next(gen);
+    if (value) return value;
+    return map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+}
@@ -0,0 +1,230 @@
+/* heap images, included by parse.leg
+ *
+ * './parse --save-image FILE prelude.txt ...' runs its inputs as usual and then writes every
+ * object reachable from the interpreter's roots to FILE: the interned symbols, 'globals'
+ * (primitives, user functions and the scopes they close over, syntax macros), 'AST' and the
+ * prototype of each kind of AST node.  './parse --image FILE ...' maps the image and
+ * rebuilds that heap before running the remaining inputs, instead of running the prelude
+ * again.
+ *
+ * The encoding is the one used by cache.c, with three more tags for maps (which carry their
+ * flags), functions and Regexes, which are written as their pattern and compiled again when
+ * the image is loaded.  Every string, symbol, map and function is numbered when it is first
+ * written and referred to by number afterwards, so sharing and cycles (a function stored in
+ * the scope it closes over) survive the round trip; loading relocates each reference to the
+ * object newly allocated for it.  Primitives are written by their name in 'primitives[]' and
+ * so an image remains valid when the interpreter is recompiled, as long as none of the
+ * primitives it uses has been removed.  Generators, memoised functions and persistent maps hold
+ * state outside the heap (a thread, a table, a file) and cannot be saved.
+ */
+
+#define IMAGE_MAGIC     "sandbox heap image"
+#define IMAGE_VERSION   1
+
+enum {
+    IMAGE_MAP       = 'M',  // varint flags, varint size, key value key value ...
+    IMAGE_FUNCTION  = 'F',  // primitive name (empty for user functions), nul, name param body parentScope fixed
+    IMAGE_REGEX     = 'X',  // pattern
+};
+
+typedef struct imageHeader
+{
+    char     magic[sizeof(IMAGE_MAGIC)];
+    uint32_t version;
+    uint32_t floatSize;
+    uint64_t symbols;   // number of symbols written before the other roots
+} imageHeader;
+
+char *primitiveName(primitive_t function)
+{
+    for (int i= 0;  i < sizeof(primitives) / sizeof(*primitives);  ++i)
+        if (primitives[i].function == function) return primitives[i].name;
+    return NULL;
+}
+
+primitive_t primitiveNamed(char *name)
+{
+    for (int i= 0;  i < sizeof(primitives) / sizeof(*primitives);  ++i)
+        if (!strcmp(primitives[i].name, name)) return primitives[i].function;
+    return NULL;
+}
+
+// answer false if obj (or anything it contains) cannot be written
+bool imageWriteObject(cacheWriter *w, oop obj)
+{
+    switch (getType(obj)) {
+        case Map:
+        case Function:
+            break;
+        case Regex:     // not numbered: compiling its pattern again answers the same Regex from the cache
+            StringBuffer_append(&w->bytes, IMAGE_REGEX);
+            return cacheWriteObject(w, get(obj, Regex, pattern));
+        default:
+            return cacheWriteObject(w, obj);    // never a Map, so it does not recurse back here
+    }
+    ssize_t number= cacheNumber(w, obj, false);
+    if (number >= 0) {
+        StringBuffer_append(&w->bytes, CACHE_REFERENCE);
+        cacheWriteNumber(w, number / 2);
+        return true;
+    }
+    if (is(Function, obj)) {
+        primitive_t primitive= get(obj, Function, primitive);
+        char *name= primitive ? primitiveName(primitive) : "";
+        if (!name) {
+            oop body= get(obj, Function, body);
+            w->failed= is(Memo, body) ? body : obj;
+            return false;
+        }
+        cacheWriteName(w, IMAGE_FUNCTION, name);
+        return imageWriteObject(w, get(obj, Function, name))
+            && imageWriteObject(w, get(obj, Function, param))
+            && imageWriteObject(w, get(obj, Function, body))
+            && imageWriteObject(w, get(obj, Function, parentScope))
+            && imageWriteObject(w, get(obj, Function, fixed));
+    }
+    StringBuffer_append(&w->bytes, IMAGE_MAP);
+    cacheWriteNumber(w, get(obj, Map, flags));
+    cacheWriteNumber(w, map_size(obj));
+    for (size_t i= 0;  i < map_size(obj);  ++i) {
+        struct Pair *pair= &get(obj, Map, elements)[i];
+        if (!imageWriteObject(w, pair->key) || !imageWriteObject(w, pair->value)) return false;
+    }
+    return true;
+}
+
+void imageSave(char *fileName)
+{
+    cacheWriter w;
+    cacheWriterInit(&w);
+    imageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version= IMAGE_VERSION;
+    header.floatSize= sizeof(flt_t);
+    header.symbols= map_size(symbol_table);
+
+    bool ok= true;
+    for (size_t i= 0;  ok && i < map_size(symbol_table);  ++i)
+        ok= imageWriteObject(&w, get(symbol_table, Map, elements)[i].key);
+    ok= ok && imageWriteObject(&w, globals) && imageWriteObject(&w, AST);
+    #define _DO(NAME) ok= ok && imageWriteObject(&w, NAME##_proto);
+    DO_PROTOS()
+    #undef _DO
+    if (!ok) {
+        if (is(Function, w.failed))
+            fprintf(stderr, "%s: the heap contains a primitive that is not in the primitives table: %s\n", fileName,
+                    printString(get(w.failed, Function, name)));
+        else
+            fprintf(stderr, "%s: the heap contains a %s, which cannot be saved in an image\n", fileName, typeName(getType(w.failed)));
+        exit(1);
+    }
+    if (!cacheWriteFile(fileName, &header, sizeof(header), &w.bytes)) {
+        perror(fileName);
+        exit(1);
+    }
+    if (opt_v) printf("[image: %s: saved %zu objects in %zu bytes]\n", fileName, w.count, sizeof(header) + StringBuffer_position(&w.bytes));
+}
+
+// answer NULL if the image is malformed
+oop imageReadObject(cacheReader *r)
+{
+    if (r->position >= r->limit) return NULL;
+    uint64_t n;
+    switch (*r->position) {
+        case IMAGE_MAP: {
+            r->position++;
+            uint64_t flags;
+            if (!cacheReadNumber(r, &flags) || !cacheReadNumber(r, &n) || n > r->limit - r->position) return NULL;
+            oop map= OopStack_push(&r->names, makeMapCapacity(n));
+            set(map, Map, flags, flags);
+            while (n--) {
+                oop key= imageReadObject(r);    if (!key)   return NULL;
+                oop value= imageReadObject(r);  if (!value) return NULL;
+                map_set(map, key, value);
+            }
+            return map;
+        }
+        case IMAGE_FUNCTION: {
+            r->position++;
+            char *primName= cacheReadName(r);
+            if (!primName) return NULL;
+            primitive_t primitive= NULL;
+            if (*primName && !(primitive= primitiveNamed(primName))) return NULL;
+            oop func= OopStack_push(&r->names, makeFunction(primitive, null, null, null, null, null));
+            oop name, param, body, parentScope, fixed;
+            if (!(name= imageReadObject(r)) || !(param= imageReadObject(r)) || !(body= imageReadObject(r))
+                || !(parentScope= imageReadObject(r)) || !(fixed= imageReadObject(r))) return NULL;
+            set(func, Function, name,        name);
+            set(func, Function, param,       param);
+            set(func, Function, body,        body);
+            set(func, Function, parentScope, parentScope);
+            set(func, Function, fixed,       fixed);
+            return func;
+        }
+        case IMAGE_REGEX: {
+            r->position++;
+            oop pattern= imageReadObject(r);
+            if (!pattern || !is(String, pattern)) return NULL;
+            return regexCompile(pattern, "--image");
+        }
+        case CACHE_MAP:
+        case CACHE_PROTO:
+        case CACHE_MAP_REFERENCE:
+            return NULL;
+    }
+    return cacheReadObject(r);
+}
+
+// replace the interpreter's roots with those saved in fileName
+void imageLoad(char *fileName)
+{
+    int_t start= clockNanoseconds(CLOCK_MONOTONIC);
+    int fd= open(fileName, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(fileName);
+        exit(1);
+    }
+    unsigned char *data= st.st_size >= sizeof(imageHeader) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    imageHeader header;
+    if (MAP_FAILED == data || (memcpy(&header, data, sizeof(header)), memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)))) {
+        fprintf(stderr, "%s: not a heap image\n", fileName);
+        exit(1);
+    }
+    if (header.version != IMAGE_VERSION || header.floatSize != sizeof(flt_t)) {
+        fprintf(stderr, "%s: heap image was saved by an incompatible version of the interpreter\n", fileName);
+        exit(1);
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    cacheReader r= { data + sizeof(header), data + st.st_size, BUFFER_INITIALISER, BUFFER_INITIALISER };
+    bool ok= true;
+    for (uint64_t i= 0;  ok && i < header.symbols;  ++i) {
+        oop symbol= imageReadObject(&r);
+        ok= symbol && is(Symbol, symbol);
+    }
+    oop newGlobals= ok ? imageReadObject(&r) : NULL;
+    oop newAST= newGlobals ? imageReadObject(&r) : NULL;
+    ok= newGlobals && is(Map, newGlobals) && newAST && is(Map, newAST);
+    #define _DO(NAME) oop NAME##_image= ok ? imageReadObject(&r) : NULL;  ok= ok && NAME##_image && is(Map, NAME##_image);
+    DO_PROTOS()
+    #undef _DO
+    if (!ok || r.position != r.limit) {
+        fprintf(stderr, "%s: heap image is corrupt\n", fileName);
+        exit(1);
+    }
+    munmap(data, st.st_size);
+
+    globals= newGlobals;
+    AST= newAST;
+    #define _DO(NAME) NAME##_proto= NAME##_image;
+    DO_PROTOS()
+    #undef _DO
+
+    if (opt_v) {
+        printf("[image: %s: loaded %zu objects in %.3f ms]\n", fileName, OopStack_position(&r.names),
+               (clockNanoseconds(CLOCK_MONOTONIC) - start) / 1e6);
+    }
+}
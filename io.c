@@ -0,0 +1,457 @@
+/* event loop, included by parse.leg
+ *
+ * Scripts do their I/O on non-blocking file descriptors, which are plain integers:
+ *
+ *  - ioOpen(fileName, mode) opens a file ("r", "w" or "a"), ioPipe() answers [readFd, writeFd]
+ *  - ioListen(port) listens on TCP port of the loopback interface (0 for any free port, which
+ *    ioPort(fd) answers), ioListen(path) on a Unix domain socket; ioConnect(port or path)
+ *    connects to either
+ *  - ioRead(fd, callback) calls callback(data, fd) with whatever arrives on fd, and then
+ *    callback(null, fd) at the end of the input; ioRead(fd, null) stops reading
+ *  - ioAccept(fd, callback) calls callback(connection, fd) for every connection to a listener
+ *  - ioWrite(fd, string, callback) queues string to be written to fd and, if there is a
+ *    callback, calls callback(fd) once it has all been written (or callback(null) if it
+ *    cannot be)
+ *  - ioTimer(milliseconds, callback, repeat) calls callback(fd) when the time has passed (and
+ *    every milliseconds after that if repeat is true); ioClose(fd) cancels it
+ *  - ioClose(fd) closes fd, discarding anything not yet written
+ *  - ioRun() waits for and delivers events until there is nothing more to wait for, or until a
+ *    callback calls ioStop()
+ *
+ * Callbacks are called by ioRun() through apply(), or are generators made by generator(), in
+ * which case the 'yield' at which the generator is waiting answers the first argument that a
+ * function would have been passed.  An exception thrown by a callback ends ioRun() and is
+ * thrown again by it.
+ *
+ * Each descriptor read has a single buffer and a single String that refers to it, which are
+ * passed to its read callback over and over again: to keep the data for longer than the
+ * callback, copy it (with String(data), for example).  Regular files cannot be watched by
+ * epoll and are always ready, so the loop does not wait while any of them are being read or
+ * written.  The event loop belongs to whichever thread is running it, and cannot be used by
+ * parallel tasks.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#define IO_BUFFER_SIZE  65536
+
+typedef struct ioPending
+{
+    size_t  end;        // the position in output up to which it must have been written
+    oop     callback;
+} ioPending;
+
+DECLARE_BUFFER(ioPending, IoPendings);
+
+typedef struct ioWatch
+{
+    uint32_t        events;     // what is being waited for
+    bool            polled;     // registered with epoll, which regular files cannot be
+    oop             reader;     // the callbacks, or null
+    oop             acceptor;
+    oop             timer;
+    bool            repeat;
+    char           *buffer;     // the data read, IO_BUFFER_SIZE bytes
+    oop             data;       // the String passed to reader, which refers to buffer
+    StringBuffer    output;     // waiting to be written
+    size_t          written;    // how much of output has been
+    IoPendings      pending;    // the write callbacks, in order of end
+} ioWatch;
+
+ioWatch **ioWatches= NULL;      // indexed by file descriptor
+int       ioCapacity= 0;
+int       ioEpoll= -1;
+int       ioActive= 0;          // descriptors with something to wait for
+int       ioUnpolled= 0;        // of which are regular files, always ready
+bool      ioStopped= false;
+
+void ioCheck(char *name)
+{
+    if (mapOwner) runtimeError("%s: the event loop cannot be used by a parallel task", name);
+    if (ioEpoll >= 0) return;
+    ioEpoll= epoll_create1(EPOLL_CLOEXEC);
+    if (ioEpoll < 0) runtimeError("%s: %s", name, strerror(errno));
+    signal(SIGPIPE, SIG_IGN);   // a peer that has gone away is reported by write() instead
+}
+
+oop ioArgument(oop params, size_t index)
+{
+    return map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+}
+
+int ioDescriptor(oop params, char *name)
+{
+    oop fd= ioArgument(params, 0);
+    if (!isInteger(fd) || getInteger(fd) < 0) runtimeError("%s: first argument must be a file descriptor", name);
+    return getInteger(fd);
+}
+
+oop ioCallback(oop params, size_t index, char *name)
+{
+    oop callback= ioArgument(params, index);
+    if (null != callback && !is(Function, callback) && !is(Generator, callback))
+        runtimeError("%s: callback must be a function or a generator", name);
+    return callback;
+}
+
+void ioNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+ioWatch *ioWatchOf(int fd)
+{
+    return fd < ioCapacity ? ioWatches[fd] : NULL;
+}
+
+ioWatch *ioWatchNew(int fd)
+{
+    if (fd >= ioCapacity) {
+        int capacity= ioCapacity ? ioCapacity : 64;
+        while (capacity <= fd) capacity *= 2;
+        ioWatch **watches= malloc(sizeof(ioWatch *) * capacity);
+        if (ioCapacity) memcpy(watches, ioWatches, sizeof(ioWatch *) * ioCapacity);
+        ioWatches= watches;
+        ioCapacity= capacity;
+    }
+    if (!ioWatches[fd]) {
+        ioWatch *w= malloc(sizeof(ioWatch));
+        w->reader= w->acceptor= w->timer= null;
+        ioWatches[fd]= w;
+    }
+    return ioWatches[fd];
+}
+
+// tell epoll (and ioRun) what is now being waited for on fd
+void ioUpdate(int fd, ioWatch *w)
+{
+    uint32_t events= 0;
+    if (null != w->reader || null != w->acceptor || null != w->timer) events |= EPOLLIN;
+    if (w->written < StringBuffer_position(&w->output) || IoPendings_position(&w->pending)) events |= EPOLLOUT;
+    if (events == w->events) return;
+    if (!w->events) {
+        struct epoll_event event= { .events= events, .data.fd= fd };
+        w->polled= !epoll_ctl(ioEpoll, EPOLL_CTL_ADD, fd, &event);
+        if (!w->polled && EPERM != errno) runtimeError("io: %d: %s", fd, strerror(errno));
+        ioActive++;
+        ioUnpolled += !w->polled;
+    }
+    else if (!events) {
+        if (w->polled) epoll_ctl(ioEpoll, EPOLL_CTL_DEL, fd, NULL);
+        ioActive--;
+        ioUnpolled -= !w->polled;
+    }
+    else if (w->polled) {
+        struct epoll_event event= { .events= events, .data.fd= fd };
+        epoll_ctl(ioEpoll, EPOLL_CTL_MOD, fd, &event);
+    }
+    w->events= events;
+}
+
+void ioForget(int fd)
+{
+    ioWatch *w= ioWatchOf(fd);
+    if (!w) return;
+    w->reader= w->acceptor= w->timer= null;
+    StringBuffer_clear(&w->output);
+    w->written= 0;
+    IoPendings_clear(&w->pending);
+    ioUpdate(fd, w);
+    ioWatches[fd]= NULL;
+}
+
+// call callback with arg (and arg2 if it is a function), as ioRun() does when an event arrives
+void ioCall(oop scope, oop callback, oop arg, oop arg2)
+{
+    if (is(Generator, callback)) {
+        generatorSend(callback, arg);
+        return;
+    }
+    oop args= makeMap();
+    map_append(args, arg);
+    if (arg2) map_append(args, arg2);
+    apply(scope, globals, callback, args, mrAST);
+}
+
+// write as much of the output as fd will take, then call the callbacks of the writes that have completed
+void ioFlush(oop scope, int fd, ioWatch *w)
+{
+    bool failed= false;
+    while (w->written < StringBuffer_position(&w->output)) {
+        ssize_t n= write(fd, StringBuffer_buffer(&w->output) + w->written, StringBuffer_position(&w->output) - w->written);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            failed= (EAGAIN != errno && EWOULDBLOCK != errno);
+            break;
+        }
+        w->written += n;
+    }
+    if (failed) w->written= StringBuffer_position(&w->output);
+    size_t done= 0;
+    while (done < IoPendings_position(&w->pending) && IoPendings_buffer(&w->pending)[done].end <= w->written) ++done;
+    oop *callbacks= done ? malloc(sizeof(oop) * done) : NULL;
+    for (size_t i= 0;  i < done;  ++i) callbacks[i]= IoPendings_buffer(&w->pending)[i].callback;
+    memmove(IoPendings_buffer(&w->pending), IoPendings_buffer(&w->pending) + done, sizeof(ioPending) * (IoPendings_position(&w->pending) - done));
+    w->pending.position -= done;
+    if (w->written == StringBuffer_position(&w->output)) {
+        StringBuffer_clear(&w->output);
+        w->written= 0;
+    }
+    ioUpdate(fd, w);
+    for (size_t i= 0;  i < done;  ++i) ioCall(scope, callbacks[i], failed ? null : makeInteger(fd), NULL);
+}
+
+// deliver the events that epoll reported for fd (or all of them, for a regular file)
+void ioDispatch(oop scope, int fd, uint32_t events)
+{
+    ioWatch *w= ioWatchOf(fd);
+    if (!w) return;
+    if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && (w->events & EPOLLOUT)) {
+        ioFlush(scope, fd, w);
+        if (w != ioWatchOf(fd)) return;     // closed by a callback
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) || !(w->events & EPOLLIN)) return;
+    if (null != w->timer) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+        oop timer= w->timer;
+        if (!w->repeat) {
+            ioForget(fd);
+            close(fd);
+        }
+        ioCall(scope, timer, makeInteger(fd), NULL);
+    }
+    else if (null != w->acceptor) {
+        int connection= accept(fd, NULL, NULL);
+        if (connection < 0) return;
+        ioNonBlocking(connection);
+        ioCall(scope, w->acceptor, makeInteger(connection), makeInteger(fd));
+    }
+    else if (null != w->reader) {
+        if (get(w->data, String, shared) || get(w->data, String, value) != w->buffer) {
+            // kept in slices or modified by the program since the last read, so not to be overwritten
+            w->buffer= malloc(IO_BUFFER_SIZE + 1);
+            w->data= makeStringFrom(w->buffer, 0);
+        }
+        ssize_t n= read(fd, w->buffer, IO_BUFFER_SIZE);
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) return;
+        oop reader= w->reader;
+        if (n <= 0) {   // the end of the input, or an error that leaves nothing more to read
+            w->reader= null;
+            ioUpdate(fd, w);
+            ioCall(scope, reader, null, makeInteger(fd));
+            return;
+        }
+        w->buffer[n]= '\0';
+        set(w->data, String, size, n);
+        ioCall(scope, reader, w->data, makeInteger(fd));
+    }
+}
+
+oop prim_ioRun(oop scope, oop params)
+{
+    ioCheck("ioRun");
+    ioStopped= false;
+    while (ioActive && !ioStopped) {
+        struct epoll_event events[64];
+        int n= epoll_wait(ioEpoll, events, 64, ioUnpolled ? 0 : -1);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            runtimeError("ioRun: %s", strerror(errno));
+        }
+        for (int i= 0;  i < n && !ioStopped;  ++i) ioDispatch(scope, events[i].data.fd, events[i].events);
+        for (int fd= 0;  ioUnpolled && fd < ioCapacity && !ioStopped;  ++fd) {
+            ioWatch *w= ioWatches[fd];
+            if (w && w->events && !w->polled) ioDispatch(scope, fd, w->events);
+        }
+    }
+    return null;
+}
+
+oop prim_ioStop(oop scope, oop params)
+{
+    ioStopped= true;
+    return null;
+}
+
+oop prim_ioRead(oop scope, oop params)
+{
+    ioCheck("ioRead");
+    int fd= ioDescriptor(params, "ioRead");
+    oop reader= ioCallback(params, 1, "ioRead");
+    ioWatch *w= ioWatchNew(fd);
+    if (!w->buffer) {
+        w->buffer= malloc(IO_BUFFER_SIZE + 1);
+        w->data= makeStringFrom(w->buffer, 0);
+    }
+    w->reader= reader;
+    ioUpdate(fd, w);
+    return null;
+}
+
+oop prim_ioAccept(oop scope, oop params)
+{
+    ioCheck("ioAccept");
+    int fd= ioDescriptor(params, "ioAccept");
+    ioWatch *w= ioWatchNew(fd);
+    w->acceptor= ioCallback(params, 1, "ioAccept");
+    ioUpdate(fd, w);
+    return null;
+}
+
+oop prim_ioWrite(oop scope, oop params)
+{
+    ioCheck("ioWrite");
+    int fd= ioDescriptor(params, "ioWrite");
+    oop string= ioArgument(params, 1);
+    if (!is(String, string)) runtimeError("ioWrite: second argument must be a string");
+    oop callback= ioCallback(params, 2, "ioWrite");
+    ioWatch *w= ioWatchNew(fd);
+    size_t start= StringBuffer_position(&w->output), size= string_size(string), n= 0;
+    if (start == w->written) {      // nothing is waiting, so try writing straight away
+        ssize_t written= write(fd, get(string, String, value), size);
+        if (written > 0) n= written;
+    }
+    StringBuffer_grow(&w->output, start + size);
+    memcpy(StringBuffer_buffer(&w->output) + start + n, get(string, String, value) + n, size - n);
+    w->output.position= start + size;
+    w->written += n;
+    if (null != callback) IoPendings_append(&w->pending, (ioPending){ StringBuffer_position(&w->output), callback });
+    if (w->written == StringBuffer_position(&w->output) && !IoPendings_position(&w->pending)) {
+        StringBuffer_clear(&w->output);
+        w->written= 0;
+    }
+    ioUpdate(fd, w);
+    return null;
+}
+
+oop prim_ioClose(oop scope, oop params)
+{
+    int fd= ioDescriptor(params, "ioClose");
+    ioForget(fd);
+    close(fd);
+    return null;
+}
+
+oop prim_ioTimer(oop scope, oop params)
+{
+    ioCheck("ioTimer");
+    oop milliseconds= ioArgument(params, 0);
+    if (!isInteger(milliseconds) || getInteger(milliseconds) < 0) runtimeError("ioTimer: first argument must be a non-negative integer");
+    oop timer= ioCallback(params, 1, "ioTimer");
+    if (null == timer) runtimeError("ioTimer: second argument must be a function or a generator");
+    bool repeat= isTrue(ioArgument(params, 2));
+    int fd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) runtimeError("ioTimer: %s", strerror(errno));
+    int_t ms= getInteger(milliseconds);
+    struct timespec interval= { ms / 1000, ms % 1000 * 1000000 };
+    if (!ms) interval.tv_nsec= 1;      // zero would disarm it
+    struct itimerspec spec= { repeat ? interval : (struct timespec){ 0, 0 }, interval };
+    timerfd_settime(fd, 0, &spec, NULL);
+    ioWatch *w= ioWatchNew(fd);
+    w->timer= timer;
+    w->repeat= repeat;
+    ioUpdate(fd, w);
+    return makeInteger(fd);
+}
+
+oop prim_ioOpen(oop scope, oop params)
+{
+    oop name= ioArgument(params, 0), mode= ioArgument(params, 1);
+    if (!is(String, name)) runtimeError("ioOpen: first argument must be a file name");
+    int flags= O_RDONLY;
+    if (is(String, mode)) {
+        if      (!strcmp(string_value(mode), "w")) flags= O_WRONLY | O_CREAT | O_TRUNC;
+        else if (!strcmp(string_value(mode), "a")) flags= O_WRONLY | O_CREAT | O_APPEND;
+        else if ( strcmp(string_value(mode), "r")) runtimeError("ioOpen: mode must be \"r\", \"w\" or \"a\"");
+    }
+    int fd= open(string_value(name), flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    if (fd < 0) runtimeError("ioOpen: %s: %s", string_value(name), strerror(errno));
+    return makeInteger(fd);
+}
+
+oop prim_ioPipe(oop scope, oop params)
+{
+    int fds[2];
+    if (pipe(fds)) runtimeError("ioPipe: %s", strerror(errno));
+    ioNonBlocking(fds[0]);
+    ioNonBlocking(fds[1]);
+    oop pair= makeMap();
+    map_append(pair, makeInteger(fds[0]));
+    map_append(pair, makeInteger(fds[1]));
+    return pair;
+}
+
+// answer a socket for the address named by params[0]: a port of the loopback interface or a path
+int ioSocket(oop params, char *name, struct sockaddr_storage *address, socklen_t *length)
+{
+    oop where= ioArgument(params, 0);
+    memset(address, 0, sizeof(*address));
+    int family;
+    if (isInteger(where)) {
+        struct sockaddr_in *in= (struct sockaddr_in *)address;
+        in->sin_family= family= AF_INET;
+        in->sin_port= htons(getInteger(where));
+        in->sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+        *length= sizeof(*in);
+    }
+    else if (is(String, where)) {
+        struct sockaddr_un *un= (struct sockaddr_un *)address;
+        if (string_size(where) >= sizeof(un->sun_path)) runtimeError("%s: %s: socket name too long", name, string_value(where));
+        un->sun_family= family= AF_UNIX;
+        strcpy(un->sun_path, string_value(where));
+        *length= sizeof(*un);
+    }
+    else runtimeError("%s: argument must be a port number or a socket name", name);
+    int fd= socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) runtimeError("%s: %s", name, strerror(errno));
+    int on= 1;
+    if (AF_INET == family) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+oop prim_ioListen(oop scope, oop params)
+{
+    struct sockaddr_storage address;
+    socklen_t length;
+    int fd= ioSocket(params, "ioListen", &address, &length);
+    int on= 1;
+    if (AF_UNIX == address.ss_family) unlink(((struct sockaddr_un *)&address)->sun_path);
+    else setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&address, length) || listen(fd, 128)) {
+        int error= errno;
+        close(fd);
+        runtimeError("ioListen: %s", strerror(error));
+    }
+    return makeInteger(fd);
+}
+
+oop prim_ioConnect(oop scope, oop params)
+{
+    struct sockaddr_storage address;
+    socklen_t length;
+    int fd= ioSocket(params, "ioConnect", &address, &length);
+    if (connect(fd, (struct sockaddr *)&address, length) && EINPROGRESS != errno) {
+        int error= errno;
+        close(fd);
+        runtimeError("ioConnect: %s", strerror(error));
+    }
+    return makeInteger(fd);
+}
+
+oop prim_ioPort(oop scope, oop params)
+{
+    int fd= ioDescriptor(params, "ioPort");
+    struct sockaddr_in address;
+    socklen_t length= sizeof(address);
+    if (getsockname(fd, (struct sockaddr *)&address, &length) || AF_INET != address.sin_family) return null;
+    return makeInteger(ntohs(address.sin_port));
+}
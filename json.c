@@ -0,0 +1,494 @@
+/* JSON, included by parse.leg after search.c (whose searchLoad() and searchAny() it uses)
+ *
+ *  - jsonParse(s) answers the value written in JSON in the String s: an object is a Map whose
+ *    keys are Symbols, an array is an array, true and false are 1 and 0, null is null and a
+ *    number is an Integer (or a BigInt if it is too large for one) if it is written without a
+ *    fraction or exponent and a Float otherwise
+ *  - jsonStringify(x) answers x written in JSON: a Map is an array if it is one and an object
+ *    otherwise (whose keys must be Symbols, Strings or Integers; hidden keys such as __proto__
+ *    are left out), a typed array is an array, null is null and a Float that is not a number or
+ *    is infinite is null too; anything else, or a Map that contains itself, is an error
+ *
+ * The parser builds each array and object once it has read all of it, from the values collected
+ * on a stack shared by the whole document, so that each Map is allocated once at its final size
+ * and the pairs of an object are sorted once instead of inserted one at a time.  Keys are interned
+ * through a small cache of the keys seen recently in the document, since most documents repeat a
+ * few keys many times.  The characters of strings are scanned for the end of the string, a
+ * backslash or a control character thirty-two at a time, and copied in one go when (as usual)
+ * there is no escape in them.  jsonStringify() writes into a single StringBuffer, which becomes
+ * the characters of the String it answers.
+ *
+ * Keys written like __this__, which would be hidden keys (the prototype of the object, for one),
+ * are kept as Strings, so that a document cannot choose the prototypes of the Maps made from it.
+ */
+
+#include <float.h>
+
+#define JSON_DEPTH  1000    // arrays and objects nested deeper than this are an error
+#define JSON_KEYS   256     // entries in the cache of recently seen keys (a power of two)
+
+typedef struct jsonParser
+{
+    char        *start, *p, *end;
+    int          depth;
+    OopStack     values;    // the elements or keys and values of the arrays and objects being read
+    StringBuffer text;      // strings with escapes in them, and keys to intern
+    oop          keys[JSON_KEYS];
+} jsonParser;
+
+void jsonError(jsonParser *j, char *message)
+{
+    runtimeError("jsonParse: %s at offset %zu", message, (size_t)(j->p - j->start));
+}
+
+// answer the first '"', '\\' or control character from p on, or end if there is none
+TYPED_KERNEL char *jsonScan(char *p, char *end)
+{
+    bytex32_t quote= '"' - (bytex32_t){ 0 }, backslash= '\\' - (bytex32_t){ 0 }, space= ' ' - (bytex32_t){ 0 };
+    for (;  p + 32 <= end;  p += 32) {
+        bytex32_t v= searchLoad(p);
+        if (searchAny((v == quote) | (v == backslash) | (v < space))) break;
+    }
+    while (p < end && '"' != *p && '\\' != *p && (uint8_t)*p >= ' ') ++p;
+    return p;
+}
+
+void jsonSpace(jsonParser *j)
+{
+    while (j->p < j->end && (' ' == *j->p || '\n' == *j->p || '\r' == *j->p || '\t' == *j->p)) ++j->p;
+}
+
+int jsonHex(jsonParser *j)
+{
+    if (j->end - j->p < 4) jsonError(j, "incomplete \\u escape");
+    int code= 0;
+    for (int i= 0;  i < 4;  ++i) {
+        int c= *j->p++;
+        if      ('0' <= c && c <= '9') c -= '0';
+        else if ('a' <= c && c <= 'f') c -= 'a' - 10;
+        else if ('A' <= c && c <= 'F') c -= 'A' - 10;
+        else jsonError(j, "invalid \\u escape");
+        code= code * 16 + c;
+    }
+    return code;
+}
+
+void jsonUtf8(StringBuffer *b, int code)
+{
+    if (code < 0x80) StringBuffer_append(b, code);
+    else if (code < 0x800) {
+        StringBuffer_append(b, 0xC0 | code >> 6);
+        StringBuffer_append(b, 0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000) {
+        StringBuffer_append(b, 0xE0 | code >> 12);
+        StringBuffer_append(b, 0x80 | (code >> 6 & 0x3F));
+        StringBuffer_append(b, 0x80 | (code & 0x3F));
+    }
+    else {
+        StringBuffer_append(b, 0xF0 | code >> 18);
+        StringBuffer_append(b, 0x80 | (code >> 12 & 0x3F));
+        StringBuffer_append(b, 0x80 | (code >> 6 & 0x3F));
+        StringBuffer_append(b, 0x80 | (code & 0x3F));
+    }
+}
+
+// read the string starting after the opening quote at j->p; if it has no escapes answer where its
+// characters start (and their number in *size), otherwise answer NULL with them unescaped in j->text
+char *jsonChars(jsonParser *j, size_t *size)
+{
+    char *start= ++j->p;
+    char *p= jsonScan(start, j->end);
+    if (p < j->end && '"' == *p) {
+        j->p= p + 1;
+        *size= p - start;
+        return start;
+    }
+    StringBuffer_clear(&j->text);
+    for (;;) {
+        StringBuffer_appendAll(&j->text, start, p - start);
+        j->p= p;
+        if (p >= j->end) jsonError(j, "unterminated string");
+        if ('"' == *p) break;
+        if ('\\' != *p) jsonError(j, "control character in string");
+        if (++j->p >= j->end) jsonError(j, "unterminated string");
+        switch (*j->p++) {
+            case '"':   StringBuffer_append(&j->text, '"');    break;
+            case '\\':  StringBuffer_append(&j->text, '\\');   break;
+            case '/':   StringBuffer_append(&j->text, '/');    break;
+            case 'b':   StringBuffer_append(&j->text, '\b');   break;
+            case 'f':   StringBuffer_append(&j->text, '\f');   break;
+            case 'n':   StringBuffer_append(&j->text, '\n');   break;
+            case 'r':   StringBuffer_append(&j->text, '\r');   break;
+            case 't':   StringBuffer_append(&j->text, '\t');   break;
+            case 'u': {
+                int code= jsonHex(j);
+                // a surrogate pair encodes one character outside the basic multilingual plane
+                if (0xD800 <= code && code < 0xDC00 && j->end - j->p >= 6 && '\\' == j->p[0] && 'u' == j->p[1]) {
+                    char *low= j->p;
+                    j->p += 2;
+                    int next= jsonHex(j);
+                    if (0xDC00 <= next && next < 0xE000) code= 0x10000 + ((code - 0xD800) << 10) + (next - 0xDC00);
+                    else j->p= low;
+                }
+                jsonUtf8(&j->text, code);
+                break;
+            }
+            default:
+                --j->p;
+                jsonError(j, "invalid escape in string");
+        }
+        start= j->p;
+        p= jsonScan(start, j->end);
+    }
+    j->p= p + 1;
+    *size= StringBuffer_position(&j->text);
+    return NULL;
+}
+
+oop jsonString(jsonParser *j)
+{
+    size_t size;
+    char *chars= jsonChars(j, &size);
+    if (!chars) chars= StringBuffer_buffer(&j->text);
+    char *value= xmalloc_atomic(size + 1);
+    memcpy(value, chars, size);
+    return makeStringFrom(value, size);
+}
+
+oop jsonKey(jsonParser *j)
+{
+    if (j->p >= j->end || '"' != *j->p) jsonError(j, "expected a string as key");
+    size_t size;
+    char *chars= jsonChars(j, &size);
+    if (!chars) chars= StringBuffer_buffer(&j->text);
+    if (size > 4 && '_' == chars[0] && '_' == chars[1] && '_' == chars[size - 2] && '_' == chars[size - 1]) {
+        char *value= xmalloc_atomic(size + 1);
+        memcpy(value, chars, size);
+        return makeStringFrom(value, size);
+    }
+    unsigned hash= size;
+    for (size_t i= 0;  i < size;  ++i) hash= hash * 31 + (uint8_t)chars[i];
+    oop *cached= &j->keys[hash & (JSON_KEYS - 1)];
+    if (*cached) {
+        char *name= get(*cached, Symbol, name);
+        if (!strncmp(name, chars, size) && '\0' == name[size]) return *cached;
+    }
+    if (memchr(chars, '\0', size)) jsonError(j, "nul character in key");
+    if (chars != StringBuffer_buffer(&j->text)) {
+        StringBuffer_clear(&j->text);
+        StringBuffer_appendAll(&j->text, chars, size);
+    }
+    return *cached= intern(StringBuffer_contents(&j->text));
+}
+
+oop jsonNumber(jsonParser *j)
+{
+    char *start= j->p, *p= start;
+    bool negative= p < j->end && '-' == *p;
+    p += negative;
+    uint64_t value= 0;     // wraps around harmlessly for numbers too long to be an Integer
+    char *digits= p;
+    while (p < j->end && '0' <= *p && *p <= '9') value= value * 10 + (*p++ - '0');
+    if (p == digits) jsonError(j, "invalid value");
+    bool integer= p - digits <= 18, fractional= false;
+    if (p < j->end && '.' == *p) {
+        integer= false;
+        fractional= true;
+        char *fraction= ++p;
+        while (p < j->end && '0' <= *p && *p <= '9') ++p;
+        if (p == fraction) {
+            j->p= p;
+            jsonError(j, "invalid number");
+        }
+    }
+    if (p < j->end && ('e' == *p || 'E' == *p)) {
+        integer= false;
+        fractional= true;
+        ++p;
+        if (p < j->end && ('+' == *p || '-' == *p)) ++p;
+        char *exponent= p;
+        while (p < j->end && '0' <= *p && *p <= '9') ++p;
+        if (p == exponent) {
+            j->p= p;
+            jsonError(j, "invalid number");
+        }
+    }
+    j->p= p;
+    if (integer) return makeInteger(negative ? -(int_t)value : (int_t)value);
+    if (!fractional) return bigint_parse(start, p - start, 10);
+    // the number is copied as strtold() needs a nul after it, which a slice need not have
+    char number[64];
+    if (p - start >= sizeof(number)) {
+        StringBuffer_clear(&j->text);
+        StringBuffer_appendAll(&j->text, start, p - start);
+        return makeFloat(strtold(StringBuffer_contents(&j->text), NULL));
+    }
+    memcpy(number, start, p - start);
+    number[p - start]= '\0';
+    return makeFloat(strtold(number, NULL));
+}
+
+oop jsonValue(jsonParser *j);
+
+// sort count pairs by key, keeping those with the same key in the order they were read
+void jsonSort(struct Pair *pairs, struct Pair *spare, size_t count)
+{
+    if (count <= 16) {      // most objects have few keys
+        for (size_t i= 1;  i < count;  ++i) {
+            struct Pair pair= pairs[i];
+            size_t k= i;
+            for (;  k > 0 && oopcmp(pairs[k - 1].key, pair.key) > 0;  --k) pairs[k]= pairs[k - 1];
+            pairs[k]= pair;
+        }
+        return;
+    }
+    size_t half= count / 2, l= 0, r= half, k= 0;
+    jsonSort(pairs, spare, half);
+    jsonSort(pairs + half, spare, count - half);
+    while (l < half && r < count) spare[k++]= oopcmp(pairs[r].key, pairs[l].key) < 0 ? pairs[r++] : pairs[l++];
+    while (l < half) spare[k++]= pairs[l++];
+    memcpy(pairs, spare, sizeof(struct Pair) * k);
+}
+
+// make a Map from the count keys and values on the stack from base on
+oop jsonObject(jsonParser *j, size_t base, size_t count)
+{
+    struct Pair *pairs= (struct Pair *)(j->values.contents + base);
+    jsonSort(pairs, count > 16 ? malloc(sizeof(struct Pair) * count) : NULL, count);
+    oop object= makeMapCapacity(count ? count : 1);
+    struct Pair *elements= get(object, Map, elements);
+    size_t size= 0;
+    for (size_t i= 0;  i < count;  ++i) {
+        if (size > 0 && !oopcmp(elements[size - 1].key, pairs[i].key)) --size;     // the last of the same key wins
+        elements[size++]= pairs[i];
+    }
+    set(object, Map, size, size);
+    return object;
+}
+
+oop jsonCompound(jsonParser *j, char close)
+{
+    if (++j->depth > JSON_DEPTH) jsonError(j, "arrays or objects nested too deeply");
+    ++j->p;
+    size_t base= OopStack_position(&j->values);
+    jsonSpace(j);
+    if (j->p < j->end && close == *j->p) ++j->p;
+    else for (;;) {
+        if ('}' == close) {
+            OopStack_push(&j->values, jsonKey(j));
+            jsonSpace(j);
+            if (j->p >= j->end || ':' != *j->p) jsonError(j, "expected ':'");
+            ++j->p;
+        }
+        OopStack_push(&j->values, jsonValue(j));
+        jsonSpace(j);
+        if (j->p < j->end && ',' == *j->p) {
+            ++j->p;
+            jsonSpace(j);
+            continue;
+        }
+        if (j->p < j->end && close == *j->p) {
+            ++j->p;
+            break;
+        }
+        jsonError(j, '}' == close ? "expected ',' or '}'" : "expected ',' or ']'");
+    }
+    size_t count= OopStack_position(&j->values) - base;
+    oop result;
+    if ('}' == close) result= jsonObject(j, base, count / 2);
+    else {
+        result= makeMapCapacity(count ? count : 1);
+        struct Pair *elements= get(result, Map, elements);
+        for (size_t i= 0;  i < count;  ++i) {
+            elements[i].key= makeInteger(i);
+            elements[i].value= j->values.contents[base + i];
+        }
+        set(result, Map, size, count);
+    }
+    j->values.position= base;
+    --j->depth;
+    return result;
+}
+
+oop jsonLiteral(jsonParser *j, char *word, oop value)
+{
+    size_t length= strlen(word);
+    if (j->end - j->p < length || memcmp(j->p, word, length)) jsonError(j, "invalid value");
+    j->p += length;
+    return value;
+}
+
+oop jsonValue(jsonParser *j)
+{
+    jsonSpace(j);
+    if (j->p >= j->end) jsonError(j, "unexpected end of input");
+    switch (*j->p) {
+        case '{':   return jsonCompound(j, '}');
+        case '[':   return jsonCompound(j, ']');
+        case '"':   return jsonString(j);
+        case 't':   return jsonLiteral(j, "true",  makeInteger(1));
+        case 'f':   return jsonLiteral(j, "false", makeInteger(0));
+        case 'n':   return jsonLiteral(j, "null",  null);
+        default:    return jsonNumber(j);
+    }
+}
+
+oop prim_jsonParse(oop scope, oop params)
+{
+    oop s= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(String, s)) runtimeError("jsonParse: argument must be a string");
+    jsonParser j;
+    memset(&j, 0, sizeof(j));
+    j.start= j.p= get(s, String, value);
+    j.end= j.start + string_size(s);
+    oop value= jsonValue(&j);
+    jsonSpace(&j);
+    if (j.p < j.end) jsonError(&j, "unexpected characters after the value");
+    return value;
+}
+
+void jsonWriteString(StringBuffer *b, char *s, size_t size)
+{
+    static char hex[]= "0123456789abcdef";
+    char *end= s + size;
+    StringBuffer_append(b, '"');
+    for (;;) {
+        char *p= jsonScan(s, end);
+        StringBuffer_appendAll(b, s, p - s);
+        if (p == end) break;
+        StringBuffer_append(b, '\\');
+        switch (*p) {
+            case '"':   StringBuffer_append(b, '"');   break;
+            case '\\':  StringBuffer_append(b, '\\');  break;
+            case '\b':  StringBuffer_append(b, 'b');   break;
+            case '\f':  StringBuffer_append(b, 'f');   break;
+            case '\n':  StringBuffer_append(b, 'n');   break;
+            case '\r':  StringBuffer_append(b, 'r');   break;
+            case '\t':  StringBuffer_append(b, 't');   break;
+            default:
+                StringBuffer_appendAll(b, "u00", 3);
+                StringBuffer_append(b, hex[(uint8_t)*p >> 4]);
+                StringBuffer_append(b, hex[*p & 15]);
+        }
+        s= p + 1;
+    }
+    StringBuffer_append(b, '"');
+}
+
+// the shortest of 15 or more digits that reads back as the same Float (or as the same double, for
+// the elements of a Float64Array), with ".0" if it looks like an integer
+void jsonWriteFloat(StringBuffer *b, flt_t f, bool isDouble)
+{
+    if (isnan(f) || isinf(f)) {
+        StringBuffer_appendAll(b, "null", 4);
+        return;
+    }
+    char number[48];
+    int length= 0, most= isDouble ? DBL_DECIMAL_DIG : DECIMAL_DIG;
+    for (int digits= 15;  digits <= most;  ++digits) {
+        length= snprintf(number, sizeof(number), "%.*Lg", digits, f);
+        if (isDouble ? strtod(number, NULL) == (double)f : strtold(number, NULL) == f) break;
+    }
+    StringBuffer_appendAll(b, number, length);
+    if (!strpbrk(number, ".e")) StringBuffer_appendAll(b, ".0", 2);
+}
+
+void jsonWriteInteger(StringBuffer *b, int64_t i)
+{
+    char number[24];
+    StringBuffer_appendAll(b, number, snprintf(number, sizeof(number), "%"PRId64, i));
+}
+
+void jsonWrite(StringBuffer *b, OopStack *writing, oop obj)
+{
+    switch (getType(obj)) {
+        case Undefined:
+            StringBuffer_appendAll(b, "null", 4);
+            return;
+        case Integer:
+            jsonWriteInteger(b, getInteger(obj));
+            return;
+        case BigInt:
+            bigint_printOn(b, obj);
+            return;
+        case Float:
+            jsonWriteFloat(b, get(obj, Float, _value), false);
+            return;
+        case String:
+            jsonWriteString(b, get(obj, String, value), string_size(obj));
+            return;
+        case Symbol:
+            jsonWriteString(b, get(obj, Symbol, name), strlen(get(obj, Symbol, name)));
+            return;
+        case Int64Array:
+        case Float64Array:
+        case ByteArray: {
+            size_t size= typedArray_size(obj);
+            StringBuffer_append(b, '[');
+            for (size_t i= 0;  i < size;  ++i) {
+                if (i) StringBuffer_append(b, ',');
+                switch (getType(obj)) {
+                    case Int64Array:    jsonWriteInteger(b, get(obj, Int64Array, elements)[i]);  break;
+                    case Float64Array:  jsonWriteFloat(b, get(obj, Float64Array, elements)[i], true);  break;
+                    default:            jsonWriteInteger(b, get(obj, ByteArray, elements)[i]);   break;
+                }
+            }
+            StringBuffer_append(b, ']');
+            return;
+        }
+        case Map:
+            break;
+        default:
+            runtimeError("jsonStringify: cannot write %s", printString(obj));
+    }
+    if (OopStack_includes(writing, obj)) runtimeError("jsonStringify: cannot write a map that contains itself");
+    OopStack_push(writing, obj);
+    size_t size= map_size(obj);
+    struct Pair *elements= get(obj, Map, elements);
+    if (map_isArray(obj)) {
+        StringBuffer_append(b, '[');
+        for (size_t i= 0;  i < size;  ++i) {
+            if (i) StringBuffer_append(b, ',');
+            jsonWrite(b, writing, elements[i].value);
+        }
+        StringBuffer_append(b, ']');
+    }
+    else {
+        StringBuffer_append(b, '{');
+        bool first= true;
+        for (size_t i= 0;  i < size;  ++i) {
+            oop key= elements[i].key;
+            if (isHidden(key)) continue;
+            if (!first) StringBuffer_append(b, ',');
+            first= false;
+            switch (getType(key)) {
+                case Integer:
+                    StringBuffer_append(b, '"');
+                    jsonWriteInteger(b, getInteger(key));
+                    StringBuffer_append(b, '"');
+                    break;
+                case String:
+                case Symbol:
+                    jsonWrite(b, writing, key);
+                    break;
+                default:
+                    runtimeError("jsonStringify: cannot write key %s", printString(key));
+            }
+            StringBuffer_append(b, ':');
+            jsonWrite(b, writing, elements[i].value);
+        }
+        StringBuffer_append(b, '}');
+    }
+    OopStack_pop(writing);
+}
+
+oop prim_jsonStringify(oop scope, oop params)
+{
+    oop obj= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    StringBuffer b= BUFFER_INITIALISER;
+    OopStack writing= BUFFER_INITIALISER;
+    jsonWrite(&b, &writing, obj);
+    size_t size= StringBuffer_position(&b);
+    return makeStringFrom(StringBuffer_contents(&b), size);
+}
@@ -0,0 +1,335 @@
+/* memoisation, included by parse.leg
+ *
+ * memoize(fn, options) answers a function that calls fn the first time it is given some
+ * arguments and answers the same result, without calling fn, whenever it is given them again.
+ * Arguments are the same when they are equal integers, floats, strings or symbols, or arrays of
+ * the same arguments; other maps, functions, and so on, are the same only when they are the same
+ * object.  The arguments whose result is remembered are copied (the arrays and strings among
+ * them), so modifying them afterwards does not change what is remembered.  fn is called with
+ * the global scope as 'this'.
+ *
+ * options.capacity, if given, is the largest number of results remembered; the least recently
+ * used result is forgotten to make room for a new one.  memoStats(f) answers a map of the hits,
+ * misses and evictions of memoised function f and of the number of results it remembers (size)
+ * and can remember (capacity, or 0 for no limit); memoClear(f) forgets them all.
+ *
+ * The results are entries of an array, linked into a list from the most to the least recently
+ * used, that are found through an open addressed hash table of their indices, hashed on the
+ * contents of the arguments.  A memoised function is a primitive whose body is a Memo holding
+ * the table.  The table is locked while it is searched or changed, but not while fn runs, so
+ * that parallel tasks can share a memoised function.
+ */
+
+#define MEMO_DEPTH  64                  // the deepest nesting of arrays in arguments
+#define MEMO_NONE   UINT32_MAX          // the end of the list of entries
+
+typedef struct memoEntry
+{
+    uint64_t  hash;
+    oop       key;                      // a copy of the arguments
+    oop       value;
+    uint32_t  newer, older;             // the neighbours in the list, or MEMO_NONE
+} memoEntry;
+
+typedef struct memo
+{
+    memoEntry  *entries;
+    size_t      size, limit;            // the number of entries used and allocated
+    size_t      capacity;               // the most entries kept, or 0 for no limit
+    uint32_t   *slots;                  // the index of an entry plus one, or 0 for an empty slot
+    size_t      mask;                   // the number of slots minus one
+    uint32_t    newest, oldest;
+    size_t      hits, misses, evictions;
+#if (USE_THREADS)
+    pthread_mutex_t lock;
+#endif
+} memo;
+
+// hashing and comparing arguments
+
+static inline uint64_t memoMix(uint64_t h, uint64_t x)
+{
+    h= (h ^ x) * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 29);
+}
+
+uint64_t memoHash(oop obj, int depth)
+{
+    switch (getType(obj)) {
+        case Integer:
+            return memoMix(Integer, getInteger(obj));
+        case Float: {
+            // from the value rather than the bytes of the flt_t, some of which may be padding
+            flt_t value= get(obj, Float, _value);
+            if (value != value) return memoMix(Float, 1);   // every NaN is the same argument
+            if (value == 0) return memoMix(Float, 0);       // and so are 0 and -0
+            if (isinf(value)) return memoMix(Float, value < 0 ? 2 : 3);
+            int exponent;
+            flt_t mantissa= fabsl(frexpl(value, &exponent));    // in [0.5, 1), exactly
+            uint64_t h= memoMix(memoMix(Float, value < 0), exponent);
+            return memoMix(h, (uint64_t)(mantissa * 0x1p64L));
+        }
+        case BigInt: {
+            uint64_t h= memoMix(BigInt, get(obj, BigInt, negative));
+            for (size_t i= 0;  i < get(obj, BigInt, size);  ++i) h= memoMix(h, get(obj, BigInt, limbs)[i]);
+            return h;
+        }
+        case String: {
+            char *p= get(obj, String, value);
+            size_t n= string_size(obj), i= 0;
+            uint64_t h= memoMix(String, n), word;
+            for (;  i + 8 <= n;  i += 8) {
+                memcpy(&word, p + i, 8);
+                h= memoMix(h, word);
+            }
+            word= 0;
+            memcpy(&word, p + i, n - i);
+            return memoMix(h, word);
+        }
+        case Map: {
+            if (!map_isArray(obj)) break;
+            if (depth == MEMO_DEPTH) runtimeError("memoize: arguments nested too deeply");
+            size_t n= map_size(obj);
+            uint64_t h= memoMix(Map, n);
+            for (size_t i= 0;  i < n;  ++i) h= memoMix(h, memoHash(get(obj, Map, elements)[i].value, depth + 1));
+            return h;
+        }
+        default:
+            break;
+    }
+    return memoMix(getType(obj), (uintptr_t)obj);
+}
+
+bool memoEqual(oop a, oop b)
+{
+    if (a == b) return true;
+    if (getType(a) != getType(b)) return false;
+    switch (getType(a)) {
+        case Float: {
+            flt_t x= get(a, Float, _value), y= get(b, Float, _value);
+            return x == y || (x != x && y != y);
+        }
+        case BigInt:
+            return get(a, BigInt, negative) == get(b, BigInt, negative)
+                && get(a, BigInt, size) == get(b, BigInt, size)
+                && !memcmp(get(a, BigInt, limbs), get(b, BigInt, limbs), sizeof(uint64_t) * get(a, BigInt, size));
+        case String:
+            return string_size(a) == string_size(b)
+                && !memcmp(get(a, String, value), get(b, String, value), string_size(a));
+        case Map: {
+            if (!map_isArray(a) || !map_isArray(b) || map_size(a) != map_size(b)) return false;
+            for (size_t i= 0;  i < map_size(a);  ++i)
+                if (!memoEqual(get(a, Map, elements)[i].value, get(b, Map, elements)[i].value)) return false;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// a copy of the arrays and strings in obj, which may be modified once obj is remembered
+oop memoCopy(oop obj)
+{
+    if (is(String, obj)) return clone(obj);
+    if (!is(Map, obj) || !map_isArray(obj)) return obj;
+    size_t n= map_size(obj);
+    oop copy= makeMapCapacity(n);
+    struct Pair *from= get(obj, Map, elements), *to= get(copy, Map, elements);
+    for (size_t i= 0;  i < n;  ++i) {
+        to[i].key= from[i].key;
+        to[i].value= memoCopy(from[i].value);
+    }
+    set(copy, Map, size, n);
+    return copy;
+}
+
+// the table
+
+void memoInit(memo *m)
+{
+    m->limit= 8;
+    m->entries= malloc(sizeof(memoEntry) * m->limit);
+    m->size= 0;
+    m->mask= 15;
+    m->slots= xmalloc_atomic(sizeof(uint32_t) * (m->mask + 1));
+    m->newest= m->oldest= MEMO_NONE;
+}
+
+// the slot of the entry for key, or the empty slot where it would go
+size_t memoFind(memo *m, uint64_t hash, oop key)
+{
+    for (size_t i= hash & m->mask;  ;  i= (i + 1) & m->mask) {
+        uint32_t e= m->slots[i];
+        if (!e) return i;
+        if (m->entries[e - 1].hash == hash && memoEqual(m->entries[e - 1].key, key)) return i;
+    }
+}
+
+// empty slot i, moving back the entries after it that would no longer be found
+void memoRemoveSlot(memo *m, size_t i)
+{
+    for (size_t j= (i + 1) & m->mask;  m->slots[j];  j= (j + 1) & m->mask) {
+        size_t home= m->entries[m->slots[j] - 1].hash & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->slots[i]= m->slots[j];
+            i= j;
+        }
+    }
+    m->slots[i]= 0;
+}
+
+void memoUnlink(memo *m, uint32_t e)
+{
+    memoEntry *entry= &m->entries[e];
+    if (entry->newer == MEMO_NONE) m->newest= entry->older;  else m->entries[entry->newer].older= entry->older;
+    if (entry->older == MEMO_NONE) m->oldest= entry->newer;  else m->entries[entry->older].newer= entry->newer;
+}
+
+void memoPush(memo *m, uint32_t e)
+{
+    memoEntry *entry= &m->entries[e];
+    entry->newer= MEMO_NONE;
+    entry->older= m->newest;
+    if (m->newest == MEMO_NONE) m->oldest= e;  else m->entries[m->newest].newer= e;
+    m->newest= e;
+}
+
+// make room for one more entry
+void memoGrow(memo *m)
+{
+    if (m->size == m->limit) {
+        memoEntry *entries= malloc(sizeof(memoEntry) * m->limit * 2);
+        memcpy(entries, m->entries, sizeof(memoEntry) * m->size);
+        m->entries= entries;
+        m->limit *= 2;
+    }
+    if (2 * (m->size + 1) <= m->mask + 1) return;
+    m->mask= 2 * m->mask + 1;
+    m->slots= xmalloc_atomic(sizeof(uint32_t) * (m->mask + 1));
+    for (uint32_t e= 0;  e < m->size;  ++e) {
+        size_t i= m->entries[e].hash & m->mask;
+        while (m->slots[i]) i= (i + 1) & m->mask;
+        m->slots[i]= e + 1;
+    }
+}
+
+// remember that the result for key, a copy of the arguments, is value
+void memoAdd(memo *m, uint64_t hash, oop key, oop value)
+{
+    size_t slot= memoFind(m, hash, key);
+    uint32_t e= m->slots[slot];
+    if (e) {                            // remembered while value was computed
+        m->entries[e - 1].value= value;
+        return;
+    }
+    if (m->capacity && m->size == m->capacity) {
+        e= m->oldest;
+        memoRemoveSlot(m, memoFind(m, m->entries[e].hash, m->entries[e].key));
+        memoUnlink(m, e);
+        ++m->evictions;
+        slot= memoFind(m, hash, key);
+    }
+    else {
+        memoGrow(m);
+        e= m->size++;
+        slot= memoFind(m, hash, key);
+    }
+    m->entries[e]= (memoEntry){ hash, key, value, MEMO_NONE, MEMO_NONE };
+    m->slots[slot]= e + 1;
+    memoPush(m, e);
+}
+
+static inline void memoLock(memo *m)
+{
+#if (USE_THREADS)
+    pthread_mutex_lock(&m->lock);
+#endif
+}
+
+static inline void memoUnlock(memo *m)
+{
+#if (USE_THREADS)
+    pthread_mutex_unlock(&m->lock);
+#endif
+}
+
+// primitives
+
+oop prim_memoCall(oop scope, oop params)
+{
+    oop memoised= get(primitiveFunction, Function, body);
+    memo *m= get(memoised, Memo, table);
+    uint64_t hash= memoHash(params, 0);
+    memoLock(m);
+    uint32_t e= m->slots[memoFind(m, hash, params)];
+    if (e) {
+        oop value= m->entries[e - 1].value;
+        if (m->newest != e - 1) {
+            memoUnlink(m, e - 1);
+            memoPush(m, e - 1);
+        }
+        ++m->hits;
+        memoUnlock(m);
+        return value;
+    }
+    ++m->misses;
+    memoUnlock(m);
+    oop key= memoCopy(params);         // before fn can modify them
+    oop value= apply(scope, globals, get(memoised, Memo, function), params, mrAST);
+    memoLock(m);
+    memoAdd(m, hash, key, value);
+    memoUnlock(m);
+    return value;
+}
+
+oop prim_memoize(oop scope, oop params)
+{
+    oop func=    map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    oop options= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    if (!is(Function, func)) runtimeError("memoize: first argument must be a function");
+    if (null != options && !is(Map, options)) runtimeError("memoize: options must be a map");
+    memo *m= malloc(sizeof(memo));
+    memoInit(m);
+    oop capacity= null == options ? null : map_get(options, intern("capacity"));
+    if (null != capacity) {
+        if (!isInteger(capacity) || getInteger(capacity) < 1 || getInteger(capacity) >= MEMO_NONE)
+            runtimeError("memoize: capacity must be a positive integer, not %s", printString(capacity));
+        m->capacity= getInteger(capacity);
+    }
+#if (USE_THREADS)
+    pthread_mutex_init(&m->lock, NULL);
+#endif
+    return makeFunction(prim_memoCall, get(func, Function, name), null, makeMemo(func, m), null, null);
+}
+
+memo *memoArgument(oop params, char *name)
+{
+    oop func= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(Function, func) || get(func, Function, primitive) != prim_memoCall)
+        runtimeError("%s: argument must be a memoised function", name);
+    return get(get(func, Function, body), Memo, table);
+}
+
+oop prim_memoStats(oop scope, oop params)
+{
+    memo *m= memoArgument(params, "memoStats");
+    oop result= makeMap();
+    memoLock(m);
+    map_set(result, intern("hits"     ), makeInteger(m->hits));
+    map_set(result, intern("misses"   ), makeInteger(m->misses));
+    map_set(result, intern("evictions"), makeInteger(m->evictions));
+    map_set(result, intern("size"     ), makeInteger(m->size));
+    map_set(result, intern("capacity" ), makeInteger(m->capacity));
+    memoUnlock(m);
+    return result;
+}
+
+oop prim_memoClear(oop scope, oop params)
+{
+    memo *m= memoArgument(params, "memoClear");
+    memoLock(m);
+    memoInit(m);
+    m->hits= m->misses= m->evictions= 0;
+    memoUnlock(m);
+    return null;
+}
@@ -0,0 +1,187 @@
+/* micro-benchmarks for the building blocks in object.c
+ *
+ * compile:    make microbench
+ *
+ * run:        ./microbench [-t milliseconds] [name-filter]
+ *
+ * Every benchmark is run repeatedly until it has consumed the time budget
+ * (100 ms by default) and reports nanoseconds, bytes allocated and number
+ * of allocations per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SYMBOL_PAYLOAD int prototype;   // object.c expects the interpreter's symbol payload
+
+#include "object.c"
+
+#define countof(ARRAY) (sizeof(ARRAY) / sizeof(*ARRAY))
+
+int_t nanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int_t)ts.tv_sec * 1000*1000*1000 + ts.tv_nsec;
+}
+
+int_t budget= 100 * 1000*1000;
+char *filter= 0;
+
+volatile oop sink;          // keeps the compiler from discarding results
+
+// state shared between a benchmark's setup and its operation
+
+int   size;                 // number of elements in the map/string being measured
+oop   map;
+oop   keys[16384];
+oop   str1, str2;
+char *names[16384];
+
+typedef void (*setup_t)(type_t keyType);
+typedef oop  (*operation_t)(size_t i);
+
+void measure(char *name, type_t keyType, int n, setup_t setup, operation_t op)
+{
+    char label[64];
+    if (keyType != Undefined) snprintf(label, sizeof(label), "%s/%s/%d", name, keyType == Integer ? "int" : keyType == Symbol ? "symbol" : "string", n);
+    else if (n)               snprintf(label, sizeof(label), "%s/%d", name, n);
+    else                      snprintf(label, sizeof(label), "%s", name);
+    if (filter && !strstr(label, filter)) return;
+
+    size= n;
+    if (setup) setup(keyType);
+    for (size_t i= 0;  i < 1000;  ++i) sink= op(i);   // warm up
+#if (USE_GC)
+    GC_gcollect();
+#endif
+    size_t iterations= 0, batch= 1;
+    unsigned long long bytes= nalloc, allocs= nallocs;
+    int_t start= nanoseconds(), elapsed;
+    while ((elapsed= nanoseconds() - start) < budget) {
+        for (size_t i= 0;  i < batch;  ++i) sink= op(iterations + i);
+        iterations += batch;
+        if (batch < 1024*1024) batch *= 2;
+    }
+    bytes= nalloc - bytes;
+    allocs= nallocs - allocs;
+    printf("%-32s %12.1f ns/op %10.1f bytes/op %8.2f allocs/op\n",
+           label, (double)elapsed / iterations, (double)bytes / iterations, (double)allocs / iterations);
+}
+
+oop makeKey(type_t keyType, int i)
+{
+    char buf[32];
+    switch (keyType) {
+        case Integer:   return makeInteger(i);
+        case Symbol:    snprintf(buf, sizeof(buf), "key%d", i);  return intern(buf);
+        case String:    snprintf(buf, sizeof(buf), "key%d", i);  return makeString(buf);
+        default:        assert(0);
+    }
+    return null;
+}
+
+void setupMap(type_t keyType)
+{
+    map= makeMap();
+    for (int i= 0;  i < size;  ++i) map_set(map, keys[i]= makeKey(keyType, i), makeInteger(i));
+}
+
+oop op_map_set(size_t i)     { return map_set(map, keys[i % size], makeInteger(i)); }
+oop op_map_get(size_t i)     { return map_get(map, keys[i % size]); }
+oop op_map_search(size_t i)  { return makeInteger(map_search(map, keys[i % size])); }
+oop op_map_miss(size_t i)    { return makeInteger(map_search(map, null)); }
+
+oop op_map_build(size_t i)
+{
+    oop m= makeMap();
+    for (int j= 0;  j < size;  ++j) map_set(m, keys[(j * 7919) % size], null);
+    return m;
+}
+
+void setupNames(type_t keyType)
+{
+    symbol_table= makeMap();
+    char buf[32];
+    for (int i= 0;  i < size;  ++i) {
+        snprintf(buf, sizeof(buf), "name%d", i);
+        names[i]= strdup(buf);
+        intern(names[i]);
+    }
+}
+
+oop op_intern(size_t i)      { return intern(names[i % size]); }
+
+oop op_intern_new(size_t i)
+{
+    symbol_table= makeMap();
+    for (int j= 0;  j < size;  ++j) intern(names[j]);
+    return symbol_table;
+}
+
+oop op_int_tagged(size_t i)  { return makeInteger(i); }
+oop op_int_boxed(size_t i)   { return makeInteger(INT64_MAX - i); }
+
+void setupStrings(type_t keyType)
+{
+    str1= makeStringFromChar('a', size);
+    str2= makeStringFromChar('b', size);
+    map= makeMap();
+    for (int i= 0;  i < size;  ++i) map_append(map, makeInteger(i));
+}
+
+oop op_string_concat(size_t i)  { return string_concat(str1, str2); }
+oop op_string_slice(size_t i)   { return string_slice(str1, size / 4, size - size / 4); }
+oop op_clone_string(size_t i)   { return clone(str1); }
+oop op_clone_map(size_t i)      { return clone(map); }
+oop op_print_map(size_t i)      { return (oop)printString(map); }
+oop op_print_int(size_t i)      { return (oop)printString(makeInteger(i)); }
+
+int main(int argc, char **argv)
+{
+#if (USE_GC)
+    GC_INIT();
+#endif
+    registerObjectThreadLocals(0);
+    symbol_table= makeMap();
+
+    for (int argn= 1;  argn < argc;  ++argn) {
+        if (!strcmp(argv[argn], "-t") && argn + 1 < argc) {
+            budget= (int_t)atoi(argv[++argn]) * 1000*1000;
+            continue;
+        }
+        filter= argv[argn];
+    }
+
+    static int sizes[]= { 8, 64, 1024, 16384 };
+    static type_t keyTypes[]= { Integer, Symbol, String };
+
+    for (int t= 0;  t < countof(keyTypes);  ++t) {
+        for (int s= 0;  s < countof(sizes);  ++s) {
+            measure("map_set",    keyTypes[t], sizes[s], setupMap, op_map_set);
+            measure("map_get",    keyTypes[t], sizes[s], setupMap, op_map_get);
+            measure("map_search", keyTypes[t], sizes[s], setupMap, op_map_search);
+            measure("map_miss",   keyTypes[t], sizes[s], setupMap, op_map_miss);
+        }
+        measure("map_build", keyTypes[t], 1024, setupMap, op_map_build);
+    }
+
+    for (int s= 0;  s < countof(sizes);  ++s) measure("intern", Undefined, sizes[s], setupNames, op_intern);
+    measure("intern_new", Undefined, 1024, setupNames, op_intern_new);
+
+    measure("makeInteger/tagged", Undefined, 0, 0, op_int_tagged);
+    measure("makeInteger/boxed",  Undefined, 0, 0, op_int_boxed);
+
+    for (int s= 0;  s < countof(sizes);  ++s) {
+        measure("string_concat", Undefined, sizes[s], setupStrings, op_string_concat);
+        measure("string_slice",  Undefined, sizes[s], setupStrings, op_string_slice);
+        measure("clone/string",  Undefined, sizes[s], setupStrings, op_clone_string);
+        measure("clone/map",     Undefined, sizes[s], setupStrings, op_clone_map);
+        measure("printString/map", Undefined, sizes[s], setupStrings, op_print_map);
+    }
+    measure("printString/int", Undefined, 0, 0, op_print_int);
+
+    return 0;
+}
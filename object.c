@@ -1,11 +1,21 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sysexits.h>
 #include <assert.h>
 
-#define USE_TAG  1
-#define USE_GC   1
+#define USE_TAG      1
+#define USE_GC       1
+#define USE_THREADS  1
+
+#if (USE_THREADS)
+# define GC_THREADS         // makes gc.h redirect pthread_create() so that new threads are registered
+# include <pthread.h>
+# define THREAD_LOCAL __thread
+#else
+# define THREAD_LOCAL
+#endif
 
 #if (USE_GC)
 # include <gc.h>
@@ -26,11 +36,13 @@ void *memcheck(void *ptr)
     return ptr;
 }
 
-unsigned long long nalloc= 0;
+THREAD_LOCAL unsigned long long nalloc= 0;   // bytes allocated (by this thread)
+THREAD_LOCAL unsigned long long nallocs= 0;  // number of allocations
 
 void *xmalloc(size_t n)
 {
     nalloc += n;
+    nallocs += 1;
 #if (USE_GC)
     void *mem= GC_malloc(n);
     assert(mem);
@@ -43,6 +55,7 @@ void *xmalloc(size_t n)
 void *xrealloc(void *p, size_t n)
 {
     nalloc += n;
+    nallocs += 1;
 #if (USE_GC)
     void *mem= GC_realloc(p, n);
     assert(mem);
@@ -52,6 +65,21 @@ void *xrealloc(void *p, size_t n)
     return mem;
 }
 
+// memory that the collector need not scan, as it will never hold pointers
+void *xmalloc_atomic(size_t n)
+{
+    nalloc += n;
+    nallocs += 1;
+#if (USE_GC)
+    void *mem= GC_malloc_atomic(n);
+    assert(mem);
+    memset(mem, 0, n);
+#else
+    void *mem= memcheck(calloc(1, n));
+#endif
+    return mem;
+}
+
 char *xstrdup(char *s)
 {
 #if (USE_GC)
@@ -60,6 +88,7 @@ char *xstrdup(char *s)
     assert(mem);
     memcpy(mem, s, len + 1);
     nalloc += len;
+    nallocs += 1;
 #else
     char *mem= memcheck(strdup(s));
 #endif
@@ -77,10 +106,18 @@ typedef enum {
     String,
     Symbol,
     Function,
-    Map
+    Map,
+    Generator,
+    Int64Array,
+    Float64Array,
+    ByteArray,
+    Regex,
+    BigInt,
+    Memo,
+    PersistentMap
 } type_t;
 
-#define NTYPES (Map + 1)
+#define NTYPES (PersistentMap + 1)
 
 union object;
 typedef union object *oop;
@@ -101,8 +138,10 @@ struct Float {
 
 struct String {
     type_t type;
-    char *value;
+    bool shared;    // slices share the characters of this String
+    char *value;    // nul-terminated, unless this is a slice
     size_t size;
+    oop base;       // for a slice, the String whose characters it shares
 };
 
 struct Symbol {
@@ -135,6 +174,8 @@ enum {
     MAP_ENCLOSED = 1 << 0,    // set when map is used as a scope and closed over by a function
 };
 
+#define MAP_OWNER_SHIFT 8     // the remaining bits of flags hold the mapOwner that created the map
+
 struct Map {
     type_t type;
     int    flags;
@@ -146,6 +187,64 @@ struct Map {
     };
 };
 
+// a source of values computed one at a time: next() answers the next value, or NULL once
+// there are no more, and keeps whatever it needs to continue in state
+typedef oop (*generator_t)(oop gen);
+
+struct Generator {
+    type_t type;
+    generator_t next;
+    void *state;
+};
+
+// arrays of numbers stored unboxed and contiguously, all three alike but for the type of elements
+struct Int64Array {
+    type_t type;
+    size_t size;
+    int64_t *elements;
+};
+
+struct Float64Array {
+    type_t type;
+    size_t size;
+    double *elements;
+};
+
+struct ByteArray {
+    type_t type;
+    size_t size;
+    uint8_t *elements;
+};
+
+// a compiled regular expression, whose program is private to the primitives that match it
+struct Regex {
+    type_t type;
+    oop pattern;
+    void *program;
+};
+
+// an integer that does not fit in an int_t, its magnitude in limbs of 64 bits (see bigint_make)
+struct BigInt {
+    type_t type;
+    bool negative;
+    size_t size;
+    uint64_t *limbs;
+};
+
+// the results remembered for a memoised function, in a table private to the primitives in memo.c
+struct Memo {
+    type_t type;
+    oop function;
+    void *table;
+};
+
+// a map kept in a file, mapped into memory, by the primitives in pmap.c
+struct PersistentMap {
+    type_t type;
+    oop path;
+    void *store;
+};
+
 union object {
     type_t type;
     struct Undefined Undefined;
@@ -155,6 +254,14 @@ union object {
     struct Symbol Symbol;
     struct Function Function;
     struct Map Map;
+    struct Generator Generator;
+    struct Int64Array Int64Array;
+    struct Float64Array Float64Array;
+    struct ByteArray ByteArray;
+    struct Regex Regex;
+    struct BigInt BigInt;
+    struct Memo Memo;
+    struct PersistentMap PersistentMap;
 };
 
 union object _null = {.Undefined = {Undefined}};
@@ -193,6 +300,17 @@ int is(type_t type, oop obj)
     return type == getType(obj);
 }
 
+char *typeName(type_t type)
+{
+    static char *names[NTYPES]= {
+        [Undefined]= "Undefined", [Integer]= "Integer", [Float]= "Float", [String]= "String",
+        [Symbol]= "Symbol", [Function]= "Function", [Map]= "Map", [Generator]= "Generator",
+        [Int64Array]= "Int64Array", [Float64Array]= "Float64Array", [ByteArray]= "ByteArray",
+        [Regex]= "Regex", [BigInt]= "BigInt", [Memo]= "Memo", [PersistentMap]= "PersistentMap",
+    };
+    return type < NTYPES ? names[type] : "unknown type";
+}
+
 oop _checkType(oop ptr, type_t type, char *file, int line)
 {
     assert(ptr);
@@ -287,6 +405,8 @@ size_t string_size(oop s)
     return get(s, String, size);
 }
 
+// answer a String sharing the characters of str from start to stop, which are copied only when
+// either String is modified or a nul-terminated C string is needed
 oop string_slice(oop str, ssize_t start, ssize_t stop) {
     assert(is(String, str));
     size_t len = string_size(str);
@@ -296,11 +416,38 @@ oop string_slice(oop str, ssize_t start, ssize_t stop) {
     if (stop  < 0 || stop  > len) return NULL;
     if (start > stop) return NULL;
 
-    size_t cpylen = stop - start;
-    char *slice= memcheck(malloc(sizeof(char) * (cpylen + 1)));
-    memcpy(slice, get(str, String, value) + start, cpylen);
-    slice[cpylen]= '\0';
-    return makeStringFrom(slice, cpylen);
+    oop base= get(str, String, base) ? get(str, String, base) : str;
+    oop slice= makeStringFrom(get(str, String, value) + start, stop - start);
+    set(slice, String, base, base);
+    set(base, String, shared, 1);
+    return slice;
+}
+
+// give s a nul-terminated copy of its characters of its own
+void string_copyValue(oop s)
+{
+    size_t size= string_size(s);
+    char *value= memcheck(malloc(sizeof(char) * (size + 1)));
+    memcpy(value, get(s, String, value), size);
+    value[size]= '\0';
+    set(s, String, value, value);
+    set(s, String, base, NULL);
+    set(s, String, shared, 0);
+}
+
+// answer the characters of s followed by a nul, first copying them out of the String they are
+// shared with if s is a slice
+char *string_value(oop s)
+{
+    if (get(s, String, base)) string_copyValue(s);
+    return get(s, String, value);
+}
+
+// answer the characters of s for modifying them, first copying them if they are shared
+char *string_unshare(oop s)
+{
+    if (get(s, String, base) || get(s, String, shared)) string_copyValue(s);
+    return get(s, String, value);
 }
 
 oop string_concat(oop str1, oop str2)
@@ -366,10 +513,524 @@ oop makeFunction(primitive_t primitive, oop name, oop param, oop body, oop paren
     return newFunc;
 }
 
+oop makeGenerator(generator_t next, void *state)
+{
+    oop newGen = malloc(sizeof(struct Generator));
+    newGen->type = Generator;
+    newGen->Generator.next = next;
+    newGen->Generator.state = state;
+    return newGen;
+}
+
+oop makeRegex(oop pattern, void *program)
+{
+    oop newRegex = malloc(sizeof(struct Regex));
+    newRegex->type = Regex;
+    newRegex->Regex.pattern = pattern;
+    newRegex->Regex.program = program;
+    return newRegex;
+}
+
+oop makeMemo(oop function, void *table)
+{
+    oop newMemo = malloc(sizeof(struct Memo));
+    newMemo->type = Memo;
+    newMemo->Memo.function = function;
+    newMemo->Memo.table = table;
+    return newMemo;
+}
+
+oop makePersistentMap(oop path, void *store)
+{
+    oop newMap = malloc(sizeof(struct PersistentMap));
+    newMap->type = PersistentMap;
+    newMap->PersistentMap.path = path;
+    newMap->PersistentMap.store = store;
+    return newMap;
+}
+
+oop generator_next(oop gen)
+{
+    assert(is(Generator, gen));
+    return get(gen, Generator, next)(gen);
+}
+
+// the size in bytes of an element of a typed array of the given type
+size_t typedArray_elementSize(type_t type)
+{
+    switch (type) {
+        case Int64Array:    return sizeof(int64_t);
+        case Float64Array:  return sizeof(double);
+        case ByteArray:     return sizeof(uint8_t);
+        default:            break;
+    }
+    assert(0);
+    return 0;
+}
+
+bool isTypedArray(oop obj)
+{
+    type_t type= getType(obj);
+    return Int64Array == type || Float64Array == type || ByteArray == type;
+}
+
+// answer a typed array of size elements, all zero
+oop makeTypedArray(type_t type, size_t size)
+{
+    oop array= malloc(sizeof(struct Int64Array));
+    array->type= type;
+    array->Int64Array.size= size;
+    array->Int64Array.elements= xmalloc_atomic(typedArray_elementSize(type) * (size ? size : 1));
+    return array;
+}
+
+// the three kinds have the same layout, so their size and elements can be reached through any of them
+size_t typedArray_size(oop array)
+{
+    assert(isTypedArray(array));
+    return array->Int64Array.size;
+}
+
+void *typedArray_elements(oop array)
+{
+    assert(isTypedArray(array));
+    return array->Int64Array.elements;
+}
+
+// answer the element that key indexes, counting from the end if it is negative, or -1 if there is none
+ssize_t typedArray_index(oop array, oop key)
+{
+    if (!isInteger(key)) return -1;
+    ssize_t i= getInteger(key), size= typedArray_size(array);
+    if (i < 0) i+= size;
+    if (i < 0 || i >= size) return -1;
+    return i;
+}
+
+oop typedArray_get(oop array, size_t i)
+{
+    switch (getType(array)) {
+        case Int64Array:    return makeInteger(get(array, Int64Array, elements)[i]);
+        case Float64Array:  return makeFloat(get(array, Float64Array, elements)[i]);
+        case ByteArray:     return makeInteger(get(array, ByteArray, elements)[i]);
+        default:            break;
+    }
+    assert(0);
+    return null;
+}
+
+// answer false if value is not a number, or is a Float that an integer array cannot hold (NaN, an
+// infinity, or one out of the range of int64_t); a Float stored in an integer array is truncated,
+// and any number stored in a ByteArray keeps only its low eight bits
+bool typedArray_set(oop array, size_t i, oop value)
+{
+    if (!isInteger(value) && !is(Float, value)) return false;
+    int64_t integer= 0;
+    if (isInteger(value)) integer= getInteger(value);
+    else if (Float64Array != getType(array)) {
+        flt_t f= get(value, Float, _value);
+        if (!(f >= -0x1p63L && f < 0x1p63L)) return false;     // converting it would be undefined
+        integer= (int64_t)f;
+    }
+    switch (getType(array)) {
+        case Int64Array:
+            get(array, Int64Array, elements)[i]= integer;
+            return true;
+        case Float64Array:
+            get(array, Float64Array, elements)[i]= isInteger(value) ? getInteger(value) : get(value, Float, _value);
+            return true;
+        case ByteArray:
+            get(array, ByteArray, elements)[i]= integer;
+            return true;
+        default:
+            break;
+    }
+    assert(0);
+    return false;
+}
+
+oop typedArray_slice(oop array, ssize_t start, ssize_t stop)
+{
+    size_t len= typedArray_size(array);
+    if (start < 0) start= start + len;
+    if (stop  < 0) stop= stop + len;
+    if (start < 0 || start > len) return NULL;
+    if (stop  < 0 || stop  > len) return NULL;
+    if (start > stop) return NULL;
+
+    size_t elementSize= typedArray_elementSize(getType(array));
+    oop slice= makeTypedArray(getType(array), stop - start);
+    memcpy(typedArray_elements(slice), (char *)typedArray_elements(array) + start * elementSize, (stop - start) * elementSize);
+    return slice;
+}
+
+// BigInts are the integers that do not fit in an int_t: arithmetic on Integers that overflows
+// answers one, and arithmetic on BigInts answers an Integer whenever the result fits in one, so
+// that every integer has only one representation.  A BigInt is immutable.  Its magnitude is held
+// in limbs of 64 bits, least significant first, and operated on by the bigint_mag functions.
+
+#define BIGINT_KARATSUBA    32      // the fewest limbs in both factors multiplied by Karatsuba's method
+#define BIGINT_DECIMAL      10000000000000000000ULL    // 10^19, the largest power of ten in a limb
+
+typedef unsigned __int128 uint128_t;
+typedef __int128          int128_t;
+
+// an integer of either kind, seen as a sign and magnitude
+typedef struct bigint_t {
+    bool      negative;
+    size_t    size;
+    uint64_t *limbs;
+    uint64_t  small;    // the limb of an Integer
+} bigint_t;
+
+void bigint_view(oop obj, bigint_t *b)
+{
+    if (is(BigInt, obj)) {
+        b->negative= get(obj, BigInt, negative);
+        b->size= get(obj, BigInt, size);
+        b->limbs= get(obj, BigInt, limbs);
+        return;
+    }
+    int_t value= getInteger(obj);
+    b->negative= value < 0;
+    b->small= b->negative ? 0 - (uint64_t)value : (uint64_t)value;
+    b->size= b->small != 0;
+    b->limbs= &b->small;
+}
+
+size_t bigint_magSize(uint64_t *limbs, size_t size)
+{
+    while (size && !limbs[size - 1]) --size;
+    return size;
+}
+
+// answer an Integer if the size limbs fit in one, or else a BigInt holding them
+oop bigint_make(bool negative, uint64_t *limbs, size_t size)
+{
+    size= bigint_magSize(limbs, size);
+    if (0 == size) return makeInteger(0);
+    if (1 == size && limbs[0] <= (uint64_t)INT64_MAX) return makeInteger(negative ? -(int_t)limbs[0] : (int_t)limbs[0]);
+    if (1 == size && negative && limbs[0] == (uint64_t)INT64_MAX + 1) return makeInteger(INT64_MIN);
+    oop big= malloc(sizeof(struct BigInt));
+    big->type= BigInt;
+    big->BigInt.negative= negative;
+    big->BigInt.size= size;
+    big->BigInt.limbs= limbs;
+    return big;
+}
+
+uint64_t *bigint_limbs(size_t size)
+{
+    return xmalloc_atomic(sizeof(uint64_t) * (size ? size : 1));
+}
+
+int bigint_magCompare(uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    na= bigint_magSize(a, na);
+    nb= bigint_magSize(b, nb);
+    if (na != nb) return na < nb ? -1 : 1;
+    while (na--)
+        if (a[na] != b[na]) return a[na] < b[na] ? -1 : 1;
+    return 0;
+}
+
+// r= a + b (na >= nb), r having na + 1 limbs
+void bigint_magAdd(uint64_t *r, uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    uint64_t carry= 0;
+    for (size_t i= 0;  i < na;  ++i) {
+        uint128_t sum= (uint128_t)a[i] + (i < nb ? b[i] : 0) + carry;
+        r[i]= (uint64_t)sum;
+        carry= sum >> 64;
+    }
+    r[na]= carry;
+}
+
+// r= a - b (a >= b, na >= nb), r having na limbs
+void bigint_magSub(uint64_t *r, uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    uint64_t borrow= 0;
+    for (size_t i= 0;  i < na;  ++i) {
+        uint64_t x= a[i], y= i < nb ? b[i] : 0;
+        r[i]= x - y - borrow;
+        borrow= x < y || (x == y && borrow);
+    }
+}
+
+// r += x, r having enough limbs for the sum
+void bigint_magAddTo(uint64_t *r, uint64_t *x, size_t nx)
+{
+    uint64_t carry= 0;
+    size_t i= 0;
+    for (;  i < nx;  ++i) {
+        uint128_t sum= (uint128_t)r[i] + x[i] + carry;
+        r[i]= (uint64_t)sum;
+        carry= sum >> 64;
+    }
+    for (;  carry;  ++i) carry= 0 == ++r[i];
+}
+
+// r -= x, r being at least x
+void bigint_magSubFrom(uint64_t *r, uint64_t *x, size_t nx)
+{
+    uint64_t borrow= 0;
+    size_t i= 0;
+    for (;  i < nx;  ++i) {
+        uint64_t y= x[i];
+        uint64_t d= r[i] - y - borrow;
+        borrow= r[i] < y || (r[i] == y && borrow);
+        r[i]= d;
+    }
+    for (;  borrow;  ++i) borrow= 0 == r[i]--;
+}
+
+// r= a * b, r having na + nb limbs
+void bigint_magMulSchool(uint64_t *r, uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    memset(r, 0, sizeof(uint64_t) * (na + nb));
+    for (size_t i= 0;  i < na;  ++i) {
+        uint64_t carry= 0, x= a[i];
+        if (!x) continue;
+        for (size_t j= 0;  j < nb;  ++j) {
+            uint128_t product= (uint128_t)x * b[j] + r[i + j] + carry;
+            r[i + j]= (uint64_t)product;
+            carry= product >> 64;
+        }
+        r[i + nb]= carry;
+    }
+}
+
+// r= a * b, r having na + nb limbs: a * b = z2 * B^2h + (z1 - z2 - z0) * B^h + z0, where
+// z2 = a1 * b1, z0 = a0 * b0 and z1 = (a0 + a1) * (b0 + b1), three products of half the size
+void bigint_magMul(uint64_t *r, uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    if (na < nb) {
+        uint64_t *t= a;  a= b;  b= t;
+        size_t    n= na; na= nb; nb= n;
+    }
+    if (nb < BIGINT_KARATSUBA) {
+        bigint_magMulSchool(r, a, na, b, nb);
+        return;
+    }
+    if (2 * nb <= na) {     // too unequal to split both: multiply b by pieces of a its size
+        memset(r, 0, sizeof(uint64_t) * (na + nb));
+        uint64_t *piece= bigint_limbs(2 * nb);
+        for (size_t i= 0;  i < na;  i += nb) {
+            size_t n= na - i < nb ? na - i : nb;
+            bigint_magMul(piece, a + i, n, b, nb);
+            bigint_magAddTo(r + i, piece, bigint_magSize(piece, n + nb));
+        }
+        return;
+    }
+    size_t h= (na + 1) / 2;     // nb > h
+    uint64_t *sa= bigint_limbs(h + 1), *sb= bigint_limbs(h + 1), *z1= bigint_limbs(2 * h + 2);
+    bigint_magMul(r, a, h, b, h);                           // z0
+    bigint_magMul(r + 2 * h, a + h, na - h, b + h, nb - h); // z2
+    bigint_magAdd(sa, a, h, a + h, na - h);
+    bigint_magAdd(sb, b, h, b + h, nb - h);
+    bigint_magMul(z1, sa, h + 1, sb, h + 1);
+    bigint_magSubFrom(z1, r, bigint_magSize(r, 2 * h));
+    bigint_magSubFrom(z1, r + 2 * h, bigint_magSize(r + 2 * h, na + nb - 2 * h));
+    bigint_magAddTo(r + h, z1, bigint_magSize(z1, 2 * h + 2));
+}
+
+// q= a / d, answering the remainder, q having na limbs
+uint64_t bigint_magDivSmall(uint64_t *q, uint64_t *a, size_t na, uint64_t d)
+{
+    uint64_t rem= 0;
+    for (size_t i= na;  i--;  ) {
+        uint128_t n= (uint128_t)rem << 64 | a[i];
+        q[i]= (uint64_t)(n / d);
+        rem= (uint64_t)(n % d);
+    }
+    return rem;
+}
+
+// q= a / b and r= a % b (Knuth's algorithm D), q having na - nb + 1 limbs and r nb limbs, for
+// na >= nb > 1 and b[nb - 1] != 0
+void bigint_magDiv(uint64_t *q, uint64_t *r, uint64_t *a, size_t na, uint64_t *b, size_t nb)
+{
+    // shift both so that the top bit of b is set, which keeps the estimates of q within two of it
+    int s= __builtin_clzll(b[nb - 1]);
+    uint64_t *u= bigint_limbs(na + 1), *v= bigint_limbs(nb);
+    for (size_t i= nb;  i-- > 0;  ) v[i]= s ? b[i] << s | (i ? b[i - 1] >> (64 - s) : 0) : b[i];
+    u[na]= s ? a[na - 1] >> (64 - s) : 0;
+    for (size_t i= na;  i-- > 0;  ) u[i]= s ? a[i] << s | (i ? a[i - 1] >> (64 - s) : 0) : a[i];
+    for (size_t j= na - nb + 1;  j-- > 0;  ) {
+        uint128_t n= (uint128_t)u[j + nb] << 64 | u[j + nb - 1];
+        uint128_t qhat= n / v[nb - 1], rhat= n % v[nb - 1];
+        while (qhat >> 64 || qhat * v[nb - 2] > (rhat << 64 | u[j + nb - 2])) {
+            --qhat;
+            rhat += v[nb - 1];
+            if (rhat >> 64) break;
+        }
+        int128_t borrow= 0, t;
+        for (size_t i= 0;  i < nb;  ++i) {
+            uint128_t p= qhat * v[i];
+            t= (int128_t)u[i + j] - borrow - (uint64_t)p;
+            u[i + j]= (uint64_t)t;
+            borrow= (int128_t)(p >> 64) - (t >> 64);
+        }
+        t= (int128_t)u[j + nb] - borrow;
+        u[j + nb]= (uint64_t)t;
+        q[j]= (uint64_t)qhat;
+        if (t < 0) {            // qhat was one too large: add b back
+            --q[j];
+            uint64_t carry= 0;
+            for (size_t i= 0;  i < nb;  ++i) {
+                uint128_t sum= (uint128_t)u[i + j] + v[i] + carry;
+                u[i + j]= (uint64_t)sum;
+                carry= sum >> 64;
+            }
+            u[j + nb] += carry;
+        }
+    }
+    for (size_t i= 0;  i < nb;  ++i) r[i]= s ? u[i] >> s | u[i + 1] << (64 - s) : u[i];
+}
+
+oop bigint_addSigned(oop lhs, oop rhs, bool negate)
+{
+    bigint_t a, b, *x= &a, *y= &b;     // swapped through pointers, as limbs may point into them
+    bigint_view(lhs, &a);
+    bigint_view(rhs, &b);
+    b.negative ^= negate;
+    if (a.negative == b.negative) {
+        if (a.size < b.size) { x= &b;  y= &a; }
+        uint64_t *r= bigint_limbs(x->size + 1);
+        bigint_magAdd(r, x->limbs, x->size, y->limbs, y->size);
+        return bigint_make(x->negative, r, x->size + 1);
+    }
+    if (bigint_magCompare(a.limbs, a.size, b.limbs, b.size) < 0) { x= &b;  y= &a; }
+    uint64_t *r= bigint_limbs(x->size);
+    bigint_magSub(r, x->limbs, x->size, y->limbs, y->size);
+    return bigint_make(x->negative, r, x->size);
+}
+
+oop bigint_add(oop lhs, oop rhs) { return bigint_addSigned(lhs, rhs, false); }
+oop bigint_sub(oop lhs, oop rhs) { return bigint_addSigned(lhs, rhs, true);  }
+
+oop bigint_mul(oop lhs, oop rhs)
+{
+    bigint_t a, b;
+    bigint_view(lhs, &a);
+    bigint_view(rhs, &b);
+    if (!a.size || !b.size) return makeInteger(0);
+    uint64_t *r= bigint_limbs(a.size + b.size);
+    bigint_magMul(r, a.limbs, a.size, b.limbs, b.size);
+    return bigint_make(a.negative != b.negative, r, a.size + b.size);
+}
+
+// the quotient (truncated towards zero, as for Integers) or the remainder (of the sign of lhs)
+// of dividing by rhs, which must not be zero
+oop bigint_divide(oop lhs, oop rhs, bool remainder)
+{
+    bigint_t a, b;
+    bigint_view(lhs, &a);
+    bigint_view(rhs, &b);
+    if (bigint_magCompare(a.limbs, a.size, b.limbs, b.size) < 0) return remainder ? lhs : makeInteger(0);
+    uint64_t *q= bigint_limbs(a.size), *r= bigint_limbs(b.size);
+    if (1 == b.size) r[0]= bigint_magDivSmall(q, a.limbs, a.size, b.limbs[0]);
+    else bigint_magDiv(q, r, a.limbs, a.size, b.limbs, b.size);
+    if (remainder) return bigint_make(a.negative, r, b.size);
+    return bigint_make(a.negative != b.negative, q, a.size);
+}
+
+oop bigint_negate(oop obj)
+{
+    bigint_t a;
+    bigint_view(obj, &a);
+    uint64_t *r= bigint_limbs(a.size);
+    memcpy(r, a.limbs, sizeof(uint64_t) * a.size);
+    return bigint_make(!a.negative, r, a.size);
+}
+
+int bigint_compare(oop lhs, oop rhs)
+{
+    bigint_t a, b;
+    bigint_view(lhs, &a);
+    bigint_view(rhs, &b);
+    if (a.negative != b.negative) return a.negative ? -1 : 1;
+    int cmp= bigint_magCompare(a.limbs, a.size, b.limbs, b.size);
+    return a.negative ? -cmp : cmp;
+}
+
+flt_t bigint_toFloat(oop obj)
+{
+    flt_t value= 0;
+    for (size_t i= get(obj, BigInt, size);  i--;  ) value= value * 18446744073709551616.0L + get(obj, BigInt, limbs)[i];
+    return get(obj, BigInt, negative) ? -value : value;
+}
+
+// the integer written in base with the n characters of digits (with an optional sign), or NULL
+// if they are not all digits
+oop bigint_parse(char *digits, size_t n, int base)
+{
+    bool negative= false;
+    if (n && ('-' == *digits || '+' == *digits)) {
+        negative= '-' == *digits++;
+        --n;
+    }
+    if (!n) return NULL;
+    // several digits at a time, as many as fit in a limb
+    uint64_t chunk= base;
+    int perChunk= 1;
+    while (chunk <= UINT64_MAX / base) {
+        chunk *= base;
+        ++perChunk;
+    }
+    uint64_t *limbs= bigint_limbs(n / perChunk + 2);
+    size_t size= 0;
+    for (size_t i= 0;  i < n;  ) {
+        uint64_t value= 0, scale= 1;
+        for (int k= 0;  k < perChunk && i < n;  ++k, ++i) {
+            int c= digits[i], d= '0' <= c && c <= '9' ? c - '0' : 'a' <= c && c <= 'z' ? c - 'a' + 10 : 'A' <= c && c <= 'Z' ? c - 'A' + 10 : 99;
+            if (d >= base) return NULL;
+            value= value * base + d;
+            scale *= base;
+        }
+        uint64_t carry= value;      // limbs= limbs * scale + value
+        for (size_t j= 0;  j < size;  ++j) {
+            uint128_t product= (uint128_t)limbs[j] * scale + carry;
+            limbs[j]= (uint64_t)product;
+            carry= product >> 64;
+        }
+        if (carry) limbs[size++]= carry;
+    }
+    return bigint_make(negative, limbs, size);
+}
+
+void bigint_printOn(StringBuffer *buf, oop obj)
+{
+    // the decimal digits nineteen at a time, least significant first, from dividing by 10^19
+    size_t size= get(obj, BigInt, size), count= 0;
+    uint64_t *q= bigint_limbs(size), *chunks= bigint_limbs(size * 20 / 19 + 1);
+    memcpy(q, get(obj, BigInt, limbs), sizeof(uint64_t) * size);
+    while ((size= bigint_magSize(q, size))) chunks[count++]= bigint_magDivSmall(q, q, size, BIGINT_DECIMAL);
+    char tmp[24];
+    if (get(obj, BigInt, negative)) StringBuffer_append(buf, '-');
+    StringBuffer_appendAll(buf, tmp, snprintf(tmp, sizeof(tmp), "%" PRIu64, chunks[--count]));
+    while (count--) StringBuffer_appendAll(buf, tmp, snprintf(tmp, sizeof(tmp), "%019" PRIu64, chunks[count]));
+}
+
+// Maps are not synchronised.  A thread running a parallel task sets mapOwner to a number
+// unique to that task and may then modify only the maps it has created (which carry that
+// number in their flags); modifying any other map calls MAP_SHARED_WRITE().  Threads with a
+// mapOwner of zero may modify any map, and must not run at the same time as parallel tasks.
+THREAD_LOCAL unsigned mapOwner= 0;
+
+#define map_owner(MAP)  ((unsigned)(MAP)->Map.flags >> MAP_OWNER_SHIFT)
+
+#ifndef MAP_SHARED_WRITE
+# define MAP_SHARED_WRITE(MAP)  (fprintf(stderr, "\nmodifying a map shared between parallel tasks\n"), exit(1))
+#endif
+
+#define map_checkWrite(MAP)     if (mapOwner && map_owner(MAP) != mapOwner) MAP_SHARED_WRITE(MAP)
+
 oop makeMap()
 {
     oop newMap = malloc(sizeof(struct Map));            assert(0 == newMap->Map.flags);
     newMap->type = Map;
+    newMap->Map.flags = mapOwner << MAP_OWNER_SHIFT;
     return newMap;
 }
 
@@ -406,6 +1067,10 @@ bool map_isArray(oop map)
 int oopcmp(oop a, oop b)
 {
     type_t ta = getType(a), tb = getType(b);
+    if (BigInt == ta || BigInt == tb) {     // BigInts go among the Integers, in order of value
+        if ((BigInt == ta || Integer == ta) && (BigInt == tb || Integer == tb)) return bigint_compare(a, b);
+        if (BigInt == ta) ta= Integer;  else tb= Integer;
+    }
     if (ta == tb) {
         switch (getType(a)) {
             case Integer: {
@@ -420,8 +1085,14 @@ int oopcmp(oop a, oop b)
                 if (l > r) return  1;
                 return 0;
             }
-            case String:
-                return strcmp(get(a, String, value), get(b, String, value));
+            case String: {
+                size_t l= string_size(a), r= string_size(b);
+                int cmp= memcmp(get(a, String, value), get(b, String, value), l < r ? l : r);
+                if (cmp) return cmp;
+                if (l < r) return -1;
+                if (l > r) return  1;
+                return 0;
+            }
             default: {
                 intptr_t l= (intptr_t)a, r= (intptr_t)b;
                 if (l < r) return -1;
@@ -483,6 +1154,7 @@ oop map_insert(oop map, oop key, oop value, size_t pos)
     assert(is(Map, map));
     assert(key);
     assert(value);
+    map_checkWrite(map);
     if (pos > map_size(map)) { // don't need to check for pos < 0 because size_t is unsigned
         fprintf(stderr, "\nTrying to insert in a map out of bound\n");
         assert(-1);
@@ -514,6 +1186,7 @@ oop map_set(oop map, oop key, oop value)
     assert(value);
     ssize_t pos = map_search(map, key);
     if (pos >= 0) {
+        map_checkWrite(map);
         get(map, Map, elements)[pos].value = value;
     } else {
         pos = -1 - pos;
@@ -526,6 +1199,7 @@ oop map_del(oop map, oop key)
 {
     assert(is(Map, map));
     assert(is(String, key));
+    map_checkWrite(map);
     ssize_t pos = map_search(map, key);
     if (pos < 0) return map;
     if (pos < map_size(map) - 1) {
@@ -622,19 +1296,80 @@ oop map_slice(oop map, ssize_t start, ssize_t stop) {
     if (stop  < 0 || stop  > len) return NULL;
     if (start > stop) return NULL;
 
-    oop slice= makeMap();
-    if (start < stop) {
-        if (!map_hasIntegerKey(map, start   )) return NULL;
-        if (!map_hasIntegerKey(map, stop - 1)) return NULL;
-        for (size_t i= start; i < stop; ++i) {
-            map_append(slice, get(map, Map, elements)[i].value);
-        }
+    if (start == stop) return makeMap();
+    if (!map_hasIntegerKey(map, start   )) return NULL;
+    if (!map_hasIntegerKey(map, stop - 1)) return NULL;
+    // so the keys from start to stop are all the integers between them, in order
+    size_t size= stop - start;
+    oop slice= makeMapCapacity(size);
+    struct Pair *elements= get(slice, Map, elements);
+    for (size_t i= 0; i < size; ++i) {
+        elements[i].key= makeInteger(i);
+        elements[i].value= get(map, Map, elements)[start + i].value;
     }
+    set(slice, Map, size, size);
     return slice;
 }
 
+oop clone(oop obj)
+{
+    switch(getType(obj)) {
+        case Undefined:
+        case Integer:
+        case Float:
+        case Symbol:
+            return obj;
+        case String: {
+            size_t size= string_size(obj);
+            char *value= malloc(sizeof(char) * (size + 1));
+            memcpy(value, get(obj, String, value), size);
+            value[size]= '\0';
+            return makeStringFrom(value, size);
+        }
+        case Map: {
+            struct Pair *elements= malloc(sizeof(struct Pair) * get(obj, Map, capacity));
+            memcpy(elements, get(obj, Map, elements), sizeof(struct Pair) * get(obj, Map, capacity));
+            oop map= malloc(sizeof(*obj));
+            memcpy(map, obj, sizeof(*obj));
+            set(map, Map, elements, elements);
+            set(map, Map, flags, (get(map, Map, flags) & ((1 << MAP_OWNER_SHIFT) - 1)) | mapOwner << MAP_OWNER_SHIFT);
+            return map;
+        }
+        case Function: {
+            oop fun= malloc(sizeof(*obj));
+            memcpy(fun, obj, sizeof(*obj));
+            return fun;
+        }
+        case Generator:     // its state cannot be copied
+        case Regex:         // nor need its program be
+        case BigInt:        // nor can it be modified
+        case Memo:          // nor need its table be
+        case PersistentMap: // nor its file
+            return obj;
+        case Int64Array:
+        case Float64Array:
+        case ByteArray:
+            return typedArray_slice(obj, 0, typedArray_size(obj));
+    }
+    return obj;
+}
+
 DECLARE_BUFFER(oop, OopStack);
-OopStack printing = BUFFER_INITIALISER;
+
+// The collector does not scan thread-local storage, so the thread-locals that refer to objects are
+// kept in a block of uncollectable memory (which it does scan) that each thread allocates when it
+// registers its thread-locals and frees when it unregisters them.  A program that includes this
+// file asks for a larger block and keeps its own such thread-locals after these (see parse.leg).
+typedef struct objectRoots_t
+{
+    OopStack     printing;      // the Maps being printed, to detect cycles
+    StringBuffer printBuffer;   // the characters of the last printString()
+} objectRoots_t;
+
+THREAD_LOCAL objectRoots_t *objectRoots= NULL;
+
+#define printing    (objectRoots->printing)
+#define printBuffer (objectRoots->printBuffer)
 
 #define OopStack_push(s, o) OopStack_append(s, o)
 oop OopStack_pop(OopStack *s)
@@ -699,6 +1434,25 @@ void map_printOn(StringBuffer *buf, oop map, int ident)
     OopStack_pop(&printing);
 }
 
+// print as the expression that makes the same array, for example Int64Array([1, 2, 3])
+void typedArray_printOn(StringBuffer *buf, oop array)
+{
+    StringBuffer_appendString(buf, typeName(getType(array)));
+    StringBuffer_appendString(buf, "([");
+    for (size_t i= 0;  i < typedArray_size(array);  ++i) {
+        char tmp[44];
+        int length;
+        switch (getType(array)) {
+            case Int64Array:    length= snprintf(tmp, sizeof(tmp), "%" PRId64, get(array, Int64Array, elements)[i]);  break;
+            case Float64Array:  length= snprintf(tmp, sizeof(tmp), "%g", get(array, Float64Array, elements)[i]);      break;
+            default:            length= snprintf(tmp, sizeof(tmp), "%d", get(array, ByteArray, elements)[i]);         break;
+        }
+        if (i) StringBuffer_appendString(buf, ", ");
+        StringBuffer_appendAll(buf, tmp, length);
+    }
+    StringBuffer_appendString(buf, "])");
+}
+
 void printOn(StringBuffer *buf, oop obj, int indent)
 {
     assert(obj);
@@ -748,16 +1502,44 @@ void printOn(StringBuffer *buf, oop obj, int indent)
             map_printOn(buf, obj, indent);
             return;
         }
+        case Generator: {
+            StringBuffer_appendString(buf, "Generator");
+            return;
+        }
+        case Int64Array:
+        case Float64Array:
+        case ByteArray: {
+            typedArray_printOn(buf, obj);
+            return;
+        }
+        case Regex: {
+            StringBuffer_appendString(buf, "Regex:");
+            printOn(buf, get(obj, Regex, pattern), indent);
+            return;
+        }
+        case BigInt: {
+            bigint_printOn(buf, obj);
+            return;
+        }
+        case Memo: {
+            StringBuffer_appendString(buf, "Memo:");
+            printOn(buf, get(get(obj, Memo, function), Function, name), indent);
+            return;
+        }
+        case PersistentMap: {
+            StringBuffer_appendString(buf, "PersistentMap:");
+            printOn(buf, get(obj, PersistentMap, path), indent);
+            return;
+        }
     }
     assert(0);
 }
 
 char *printString(oop obj)
 {
-    static StringBuffer buf= BUFFER_INITIALISER;
-    StringBuffer_clear(&buf);
-    printOn(&buf, obj, 0);
-    return StringBuffer_contents(&buf);
+    StringBuffer_clear(&printBuffer);
+    printOn(&printBuffer, obj, 0);
+    return StringBuffer_contents(&printBuffer);
 }
 
 void print(oop obj)
@@ -773,6 +1555,10 @@ void println(oop ast)
 
 oop symbol_table;
 
+#if (USE_THREADS)
+pthread_mutex_t symbol_table_lock= PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 ssize_t map_intern_search(oop map, char* ident)
 {
     assert(is(Map, map));
@@ -791,10 +1577,61 @@ ssize_t map_intern_search(oop map, char* ident)
 oop intern(char *ident)
 {
     assert(ident);
+#if (USE_THREADS)
+    pthread_mutex_lock(&symbol_table_lock);
+    unsigned owner= mapOwner;
+    mapOwner= 0;    // the symbol table belongs to everyone
+#endif
+    oop symbol;
     ssize_t pos = map_intern_search(symbol_table, ident);
-    if (pos >= 0) return get(symbol_table, Map, elements)[pos].key;
-    pos = -1 - pos; // 'un-negate' the result by reflecting it around X=-1
-    oop symbol = makeSymbol(ident);
-    map_insert(symbol_table, symbol, null, pos);
+    if (pos >= 0) {
+        symbol = get(symbol_table, Map, elements)[pos].key;
+    } else {
+        pos = -1 - pos; // 'un-negate' the result by reflecting it around X=-1
+        symbol = makeSymbol(ident);
+        map_insert(symbol_table, symbol, null, pos);
+    }
+#if (USE_THREADS)
+    mapOwner= owner;
+    pthread_mutex_unlock(&symbol_table_lock);
+#endif
     return symbol;
 }
+
+// answer the symbol named ident, or NULL if it has not been interned
+oop interned(char *ident)
+{
+#if (USE_THREADS)
+    pthread_mutex_lock(&symbol_table_lock);
+#endif
+    ssize_t pos = map_intern_search(symbol_table, ident);
+    oop symbol= (pos >= 0) ? get(symbol_table, Map, elements)[pos].key : NULL;
+#if (USE_THREADS)
+    pthread_mutex_unlock(&symbol_table_lock);
+#endif
+    return symbol;
+}
+
+// allocate this thread's block of thread-locals, of at least size bytes, answering it; a block
+// rather than a root set for each thread-local, as the collector allows only a few thousand
+// root sets and every generator is a thread
+void *registerObjectThreadLocals(size_t size)
+{
+    if (size < sizeof(objectRoots_t)) size= sizeof(objectRoots_t);
+#if (USE_GC)
+    objectRoots= memcheck(GC_malloc_uncollectable(size));
+#else
+    objectRoots= memcheck(calloc(1, size));
+#endif
+    return objectRoots;
+}
+
+void unregisterObjectThreadLocals(void)
+{
+#if (USE_GC)
+    GC_free(objectRoots);           // what its thread-locals refer to is garbage now, unless shared
+#else
+    free(objectRoots);
+#endif
+    objectRoots= NULL;
+}
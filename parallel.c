@@ -0,0 +1,328 @@
+/* parallel tasks, included by parse.leg
+ *
+ * parallelMap(array, fn) answers an array of fn(element, index) for every element of array,
+ * and parallelFor(n, fn) calls fn(i) for i from 0 to n - 1.  The calls are shared between
+ * the calling thread and a pool of worker threads (one per processor, or as many as given
+ * with '--threads N'), each of which owns a range of the indices and, once it has run out,
+ * steals half of what remains of the largest range it finds.
+ *
+ * The interpreter's per-thread state (the jb_record stack, backtrace, most recent AST, pool
+ * of free scopes and the buffers used for printing) is thread-local, so tasks can call
+ * functions, throw and print independently.  Maps are not synchronised, so a task may read
+ * any map but modify only the maps it created itself (including the scopes of the
+ * functions it calls): assigning to a global variable, a variable of an enclosing scope or a
+ * member of a shared object is a runtime error, even when the pool has a single thread.  To
+ * produce results, return them from fn.  Files cannot be imported by a task, since there is
+ * only one parser.  Nested calls of parallelMap and parallelFor run in the calling task.
+ *
+ * If a task throws, the tasks that have not started yet are abandoned and, once the others
+ * have finished, the exception is thrown again in the caller (that of the lowest index if
+ * several tasks threw).  A runtime error in a task ends the program, unless the interpreter is
+ * embedded (see sandbox.c), in which case it is treated like an exception that cannot be caught
+ * and reported to the host once the other tasks have finished.
+ */
+
+#include <limits.h>
+
+int parallelThreads= 0;     // set by --threads; 0 means one per processor
+
+// thread-local variables are not scanned by the collector, so each thread keeps those that refer
+// to objects in a block of its own that is (see objectRoots_t in object.c)
+void registerThreadLocals(void)
+{
+    threadRoots= registerObjectThreadLocals(sizeof(threadRoots_t));
+    mrAST= &_null;
+}
+
+// to be called by a thread before it exits
+void unregisterThreadLocals(void)
+{
+    unregisterObjectThreadLocals();
+    threadRoots= NULL;
+}
+
+// answer a mapOwner that is not (recently) used by any other task
+unsigned parallelNewOwner(void)
+{
+    static unsigned lastOwner= 0;
+    unsigned owner;
+    do owner= __atomic_add_fetch(&lastOwner, 1, __ATOMIC_RELAXED) & (UINT_MAX >> MAP_OWNER_SHIFT);
+    while (0 == owner);
+    return owner;
+}
+
+#if (USE_THREADS)
+
+typedef struct parallelRange
+{
+    pthread_mutex_t lock;
+    size_t          next, end;      // the indices not yet claimed by anyone
+} parallelRange;
+
+typedef struct parallelJob
+{
+    oop                 scope, func, input, ast;
+    oop                *results;        // NULL for parallelFor
+    size_t              count;
+    int                 participants;   // the caller and the workers
+    parallelRange      *ranges;         // one per participant
+    int                 active;         // workers still participating, guarded by parallelLock
+    volatile int        failed;
+    size_t              exceptionIndex;
+    oop                 exception;
+    bool                embedded;       // recover from runtime errors in the tasks
+    char               *error;          // the message of the first runtime error, if any
+    int                 errorStatus;
+    unsigned long long  nalloc, nallocs;    // allocated by the workers
+} parallelJob;
+
+pthread_mutex_t parallelLock= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  parallelStart= PTHREAD_COND_INITIALIZER;
+pthread_cond_t  parallelDone= PTHREAD_COND_INITIALIZER;
+int             parallelWorkers= 0;         // started so far
+parallelJob    *parallelCurrent= NULL;      // the job the workers are to help with
+unsigned long   parallelGeneration= 0;      // incremented for every job
+unsigned long   parallelCreated= 0;         // the generation before which new workers were created
+
+// claim the next index to run: the first of our own range, or one stolen from another participant
+bool parallelNext(parallelJob *job, int self, size_t *index)
+{
+    parallelRange *own= &job->ranges[self];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        *index= own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&own->lock);
+    for (;;) {
+        int victim= -1;
+        size_t most= 0;
+        for (int i= 0;  i < job->participants;  ++i) {
+            size_t left= job->ranges[i].end - job->ranges[i].next;     // racy, but only a hint
+            if (i != self && left > most) {
+                most= left;
+                victim= i;
+            }
+        }
+        if (victim < 0) return false;
+        parallelRange *range= &job->ranges[victim];
+        pthread_mutex_lock(&range->lock);
+        size_t left= range->end - range->next;
+        if (left) {
+            size_t stolen= (left + 1) / 2;
+            range->end -= stolen;
+            size_t start= range->end;
+            pthread_mutex_unlock(&range->lock);
+            pthread_mutex_lock(&own->lock);
+            own->next= start + 1;
+            own->end= start + stolen;
+            pthread_mutex_unlock(&own->lock);
+            *index= start;
+            return true;
+        }
+        pthread_mutex_unlock(&range->lock);
+    }
+}
+
+oop parallelCall(oop scope, oop func, oop input, size_t index, oop ast)
+{
+    oop args= makeMap();
+    if (input) map_append(args, get(input, Map, elements)[index].value);
+    map_append(args, makeInteger(index));
+    return apply(scope, globals, func, args, ast);
+}
+
+// run tasks of job until there are none left
+void parallelRun(parallelJob *job, int self)
+{
+    volatile size_t index= 0;
+    jbRecPush();
+    if (0 == sigsetjmp(jbs->jb, 0)) {
+        size_t next;
+        while (!job->failed && parallelNext(job, self, &next)) {
+            index= next;
+            oop result= parallelCall(job->scope, job->func, job->input, index, job->ast);
+            if (job->results) job->results[index]= result;
+        }
+    }
+    else {  // only an exception can get here, as apply() deals with everything else
+        pthread_mutex_lock(&parallelLock);
+        if (!job->failed || index < job->exceptionIndex) {
+            job->exceptionIndex= index;
+            job->exception= jbs->result;
+        }
+        job->failed= 1;
+        pthread_mutex_unlock(&parallelLock);
+    }
+    jbRecPop();
+}
+
+void parallelParticipate(parallelJob *job, int self)
+{
+    unsigned owner= mapOwner;
+    mapOwner= parallelNewOwner();
+    unsigned long long allocated= nalloc, allocations= nallocs;
+    sigjmp_buf recovery, *outerRecovery= errorRecovery;
+    errorState state= errorStateSave();
+    if (!job->embedded || 0 == sigsetjmp(recovery, 0)) {
+        if (job->embedded) errorRecovery= &recovery;
+        parallelRun(job, self);
+    }
+    else {
+        errorStateRestore(&state);
+        pthread_mutex_lock(&parallelLock);
+        if (!job->error) {
+            job->error= strdup(errorMessage);
+            job->errorStatus= errorStatus;
+        }
+        job->failed= 1;
+        pthread_mutex_unlock(&parallelLock);
+    }
+    errorRecovery= outerRecovery;
+    if (self) {
+        __atomic_add_fetch(&job->nalloc,  nalloc  - allocated,   __ATOMIC_RELAXED);
+        __atomic_add_fetch(&job->nallocs, nallocs - allocations, __ATOMIC_RELAXED);
+    }
+    mapOwner= owner;
+}
+
+void *parallelWorker(void *arg)
+{
+    int self= (intptr_t)arg;
+    registerThreadLocals();
+    pthread_mutex_lock(&parallelLock);
+    // the job for which this worker was created cannot finish (nor can another start) until it
+    // has taken part, so parallelCreated has not changed since
+    unsigned long generation= parallelCreated;
+    for (;;) {
+        while (generation == parallelGeneration) pthread_cond_wait(&parallelStart, &parallelLock);
+        generation= parallelGeneration;
+        parallelJob *job= parallelCurrent;
+        pthread_mutex_unlock(&parallelLock);
+        if (self < job->participants) parallelParticipate(job, self);
+        pthread_mutex_lock(&parallelLock);
+        if (0 == --job->active) pthread_cond_signal(&parallelDone);
+    }
+    return NULL;
+}
+
+// threads do not survive fork(), so a child (of the server, for example) starts its own pool
+void parallelForked(void)
+{
+    pthread_mutex_init(&parallelLock, NULL);
+    pthread_cond_init(&parallelStart, NULL);
+    pthread_cond_init(&parallelDone, NULL);
+    parallelWorkers= 0;
+}
+
+void parallelStartWorkers(int count)
+{
+    static bool registered= false;
+    if (!registered) registered= !pthread_atfork(NULL, NULL, parallelForked);
+    parallelCreated= parallelGeneration;
+    while (parallelWorkers < count) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, parallelWorker, (void *)(intptr_t)(parallelWorkers + 1))) {
+            if (opt_v) perror("parallel");
+            return;
+        }
+        pthread_detach(thread);
+        parallelWorkers++;
+    }
+}
+
+#endif // USE_THREADS
+
+// answer fn(input[i], i) (or fn(i) if input is null) for each i below count, in an array if
+// wanted, running as many of them at a time as there are threads
+oop parallelApply(oop scope, oop func, oop input, size_t count, bool wanted, oop ast)
+{
+    oop *results= wanted ? malloc(sizeof(oop) * (count ? count : 1)) : NULL;
+    int threads= parallelThreads ? parallelThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+#if (USE_THREADS)
+    if (threads > count) threads= (int)count;
+    if (!mapOwner && threads > 1) {
+        parallelStartWorkers(threads - 1);
+        if (threads > parallelWorkers + 1) threads= parallelWorkers + 1;
+        parallelJob *job= malloc(sizeof(parallelJob));
+        job->scope= scope;
+        job->func= func;
+        job->input= input;
+        job->ast= ast;
+        job->results= results;
+        job->count= count;
+        job->participants= threads;
+        job->ranges= malloc(sizeof(parallelRange) * job->participants);
+        for (int i= 0;  i < job->participants;  ++i) {
+            pthread_mutex_init(&job->ranges[i].lock, NULL);
+            job->ranges[i].next= count *  i      / job->participants;
+            job->ranges[i].end=  count * (i + 1) / job->participants;
+        }
+        job->failed= 0;
+        job->exception= null;
+        job->embedded= (NULL != errorRecovery);
+        job->error= NULL;
+        job->nalloc= job->nallocs= 0;
+
+        pthread_mutex_lock(&parallelLock);
+        job->active= parallelWorkers;
+        parallelCurrent= job;
+        parallelGeneration++;
+        pthread_cond_broadcast(&parallelStart);
+        pthread_mutex_unlock(&parallelLock);
+
+        parallelParticipate(job, 0);
+
+        pthread_mutex_lock(&parallelLock);
+        while (job->active) pthread_cond_wait(&parallelDone, &parallelLock);
+        parallelCurrent= NULL;
+        pthread_mutex_unlock(&parallelLock);
+        for (int i= 0;  i < job->participants;  ++i) pthread_mutex_destroy(&job->ranges[i].lock);
+        nalloc  += job->nalloc;
+        nallocs += job->nallocs;
+
+        if (job->error) {
+            strcpy(errorMessage, job->error);
+            recoverFromError(job->errorStatus);
+        }
+        if (job->failed) {
+            jbs->result= job->exception;
+            siglongjmp(jbs->jb, j_throw);
+        }
+    }
+    else
+#endif
+    {
+        // the same rules apply when the tasks run one after another
+        unsigned owner= mapOwner;
+        for (size_t i= 0;  i < count;  ++i) {
+            if (!owner) mapOwner= parallelNewOwner();
+            oop result= parallelCall(scope, func, input, i, ast);
+            if (results) results[i]= result;
+        }
+        mapOwner= owner;
+    }
+    if (!results) return null;
+    oop array= makeMapCapacity(count);
+    for (size_t i= 0;  i < count;  ++i) map_append(array, results[i]);
+    return array;
+}
+
+oop prim_parallelMap(oop scope, oop params)
+{
+    oop array= null;    if (map_hasIntegerKey(params, 0)) array= get(params, Map, elements)[0].value;
+    oop func= null;     if (map_hasIntegerKey(params, 1)) func= get(params, Map, elements)[1].value;
+    if (!is(Map, array) || !map_isArray(array)) runtimeError("parallelMap: first argument must be an array");
+    if (!is(Function, func)) runtimeError("parallelMap: second argument must be a function");
+    return parallelApply(scope, func, array, map_size(array), true, mrAST);
+}
+
+oop prim_parallelFor(oop scope, oop params)
+{
+    oop count= null;    if (map_hasIntegerKey(params, 0)) count= get(params, Map, elements)[0].value;
+    oop func= null;     if (map_hasIntegerKey(params, 1)) func= get(params, Map, elements)[1].value;
+    if (!isInteger(count) || getInteger(count) < 0) runtimeError("parallelFor: first argument must be a non-negative integer");
+    if (!is(Function, func)) runtimeError("parallelFor: second argument must be a function");
+    return parallelApply(scope, func, NULL, getInteger(count), false, mrAST);
+}
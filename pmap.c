@@ -0,0 +1,417 @@
+/* persistent maps, included by parse.leg
+ *
+ * PersistentMap(path) answers a map kept in the file path (created if it does not exist), which
+ * is mapped into memory rather than read, so that opening one costs the same whatever its size
+ * and only the parts of it that are used are ever read from the disk.  Its keys are strings,
+ * integers and symbols, and its values null, numbers (integers of 64 bits and floats, kept at their
+ * full precision), strings and symbols.  It is indexed like a map, pm[key] answering null for a missing key, and keys(pm),
+ * values(pm), length(pm) and 'for (k in pm)' work on it as they do on a map, though its keys are
+ * in no particular order.  Strings are copied out of the file when they are read.  sync(pm)
+ * waits for everything written to reach the disk; otherwise the system writes it back when it
+ * sees fit, which is also what happens when the PersistentMap is collected or the program exits.
+ * Only one PersistentMap at a time, in any process, can open a file, and parallel tasks can
+ * modify only those they opened.  Keys added during 'for (k in pm)' may or may not be visited,
+ * and if they make the table grow the keys already visited may be visited again.
+ *
+ * The file is a header, slot tables and records, in the byte order of the machine.  The slot
+ * table is an open addressed hash table (with linear probing) of the hash of each key and the
+ * offset of its record, which holds the key and then the value.  Records and tables are
+ * allocated at the end of the file, which grows by doubling.  A value is overwritten in its
+ * record if it fits there and otherwise written with a copy of its key in a new record; a table
+ * more than three quarters full is replaced by one twice the size.  The space of the records and
+ * tables replaced is not reused.
+ */
+
+#include <sys/file.h>
+
+#define PMAP_MAGIC      "sandbox pmap 1\n"
+#define PMAP_INITIAL    (64 * 1024)         // the size of a new file
+#define PMAP_SLOTS      1024                // the size of its table
+
+enum { PMAP_NULL, PMAP_INTEGER, PMAP_FLOAT, PMAP_STRING, PMAP_SYMBOL };
+
+typedef struct pmapHeader
+{
+    char     magic[16];
+    uint64_t count;                 // the number of keys
+    uint64_t table;                 // the offset of the slot table
+    uint64_t mask;                  // the number of slots minus one
+    uint64_t end;                   // the offset of the first byte not allocated
+} pmapHeader;
+
+typedef struct pmapSlot
+{
+    uint64_t hash;
+    uint64_t offset;                // of the record, or 0 for an empty slot
+} pmapSlot;
+
+typedef struct pmapRecord
+{
+    uint32_t keySize;               // in bytes, followed by as many as make a multiple of 8
+    uint32_t capacity;              // the bytes after the key that hold the value
+    uint64_t valueSize;
+    uint8_t  keyType, valueType;
+    uint8_t  padding[6];
+} pmapRecord;
+
+typedef struct pmap
+{
+    int       fd;
+    char     *base;                 // where the file is mapped, moved when the file grows
+    size_t    size;                 // of the file and the mapping
+    unsigned  owner;                // the mapOwner that may modify it
+} pmap;
+
+// keys and values as bytes
+
+typedef struct pmapBytes
+{
+    uint8_t  type;
+    char    *bytes;                 // or NULL for those of scalar
+    size_t   size;
+    char     scalar[sizeof(flt_t) > sizeof(int64_t) ? sizeof(flt_t) : sizeof(int64_t)];    // an integer or a float
+} pmapBytes;
+
+#define pmapData(B)     ((B)->bytes ? (B)->bytes : (B)->scalar)
+
+pmapBytes pmapKeyBytes(oop key)
+{
+    pmapBytes b= { PMAP_NULL, NULL, 0, {0} };
+    switch (getType(key)) {
+        case Integer: {
+            int64_t value= getInteger(key);
+            memcpy(b.scalar, &value, sizeof(value));
+            b.type= PMAP_INTEGER;  b.size= sizeof(value);
+            break;
+        }
+        case String:
+            b.type= PMAP_STRING;  b.bytes= get(key, String, value);  b.size= string_size(key);
+            break;
+        case Symbol:
+            b.type= PMAP_SYMBOL;  b.bytes= get(key, Symbol, name);  b.size= strlen(b.bytes);
+            break;
+        default:
+            runtimeError("PersistentMap: key must be a string, an integer or a symbol, not %s", printString(key));
+    }
+    return b;
+}
+
+pmapBytes pmapValueBytes(oop value)
+{
+    pmapBytes b= { PMAP_NULL, NULL, 0, {0} };
+    switch (getType(value)) {
+        case Undefined:
+            break;
+        case Float: {
+            flt_t f= get(value, Float, _value);
+            memcpy(b.scalar, &f, sizeof(f));
+            b.type= PMAP_FLOAT;  b.size= sizeof(f);
+            break;
+        }
+        case Integer:
+        case String:
+        case Symbol:
+            return pmapKeyBytes(value);
+        default:
+            runtimeError("PersistentMap: value must be null, a number, a string or a symbol, not %s", printString(value));
+    }
+    return b;
+}
+
+// the object made of the type and bytes of a key or value
+oop pmapObject(uint8_t type, char *bytes, size_t size)
+{
+    switch (type) {
+        case PMAP_INTEGER: {
+            int64_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return makeInteger(value);
+        }
+        case PMAP_FLOAT: {
+            flt_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return makeFloat(value);
+        }
+        case PMAP_STRING: {
+            char *value= malloc(size + 1);
+            memcpy(value, bytes, size);
+            value[size]= '\0';
+            return makeStringFrom(value, size);
+        }
+        case PMAP_SYMBOL: {
+            char *name= xmalloc_atomic(size + 1);
+            memcpy(name, bytes, size);
+            name[size]= '\0';
+            return intern(name);
+        }
+    }
+    return null;
+}
+
+static inline uint64_t pmapMix(uint64_t h, uint64_t x)
+{
+    h= (h ^ x) * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 29);
+}
+
+// the hash of a key, which is kept in the file and so must never change
+uint64_t pmapHash(pmapBytes *key)
+{
+    char *bytes= pmapData(key);
+    uint64_t h= pmapMix(key->type, key->size), word;
+    size_t i= 0;
+    for (;  i + 8 <= key->size;  i += 8) {
+        memcpy(&word, bytes + i, 8);
+        h= pmapMix(h, word);
+    }
+    word= 0;
+    memcpy(&word, bytes + i, key->size - i);
+    return pmapMix(h, word);
+}
+
+// the file
+
+#define pmapHeaderOf(P)     ((pmapHeader *)(P)->base)
+#define pmapAt(P, OFFSET)   ((void *)((P)->base + (OFFSET)))
+#define pmapAlign(N)        (((N) + 7) & ~(size_t)7)
+
+bool pmapMap(pmap *p, size_t size)
+{
+    char *base= mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+    if (MAP_FAILED == base) return false;
+    madvise(base, size, MADV_RANDOM);       // a hash table is read anywhere but in order
+    p->base= base;
+    p->size= size;
+    return true;
+}
+
+// allocate size bytes at the end of the file, growing it if needed, and answer their offset
+uint64_t pmapAllocate(pmap *p, size_t size)
+{
+    uint64_t offset= pmapHeaderOf(p)->end;
+    if (offset + size > p->size) {
+        size_t newSize= p->size;
+        while (offset + size > newSize) newSize *= 2;
+        char *oldBase= p->base;
+        size_t oldSize= p->size;
+        if (ftruncate(p->fd, newSize) || !pmapMap(p, newSize)) runtimeError("PersistentMap: %s", strerror(errno));
+        munmap(oldBase, oldSize);
+    }
+    pmapHeaderOf(p)->end= offset + size;
+    return offset;
+}
+
+// a new empty table of mask + 1 slots, filled with the keys of the old one
+void pmapResize(pmap *p, uint64_t mask)
+{
+    uint64_t table= pmapAllocate(p, sizeof(pmapSlot) * (mask + 1));
+    pmapHeader *h= pmapHeaderOf(p);
+    pmapSlot *to= pmapAt(p, table);
+    memset(to, 0, sizeof(pmapSlot) * (mask + 1));
+    if (h->table) {
+        pmapSlot *from= pmapAt(p, h->table);
+        for (uint64_t i= 0;  i <= h->mask;  ++i) {
+            if (!from[i].offset) continue;
+            uint64_t j= from[i].hash & mask;
+            while (to[j].offset) j= (j + 1) & mask;
+            to[j]= from[i];
+        }
+    }
+    h->table= table;
+    h->mask= mask;
+}
+
+#if (USE_GC)
+void pmapFinalise(void *obj, void *data)
+{
+    pmap *p= get((oop)obj, PersistentMap, store);
+    munmap(p->base, p->size);
+    close(p->fd);
+}
+#endif
+
+// the slot for key, holding its record or else empty
+pmapSlot *pmapFind(pmap *p, pmapBytes *key, uint64_t hash)
+{
+    pmapHeader *h= pmapHeaderOf(p);
+    pmapSlot *slots= pmapAt(p, h->table);
+    for (uint64_t i= hash & h->mask;  ;  i= (i + 1) & h->mask) {
+        if (!slots[i].offset) return &slots[i];
+        if (slots[i].hash != hash) continue;
+        pmapRecord *r= pmapAt(p, slots[i].offset);
+        if (r->keyType == key->type && r->keySize == key->size && !memcmp(r + 1, pmapData(key), key->size)) return &slots[i];
+    }
+}
+
+pmap *pmapStore(oop map)
+{
+    return get(map, PersistentMap, store);
+}
+
+oop pmapRecordValue(pmap *p, uint64_t offset)
+{
+    pmapRecord *r= pmapAt(p, offset);
+    return pmapObject(r->valueType, (char *)(r + 1) + pmapAlign(r->keySize), r->valueSize);
+}
+
+oop pmapRecordKey(pmap *p, uint64_t offset)
+{
+    pmapRecord *r= pmapAt(p, offset);
+    return pmapObject(r->keyType, (char *)(r + 1), r->keySize);
+}
+
+// the value of key in map, or null
+oop pmapGet(oop map, oop key)
+{
+    pmap *p= pmapStore(map);
+    pmapBytes k= pmapKeyBytes(key);
+    pmapSlot *slot= pmapFind(p, &k, pmapHash(&k));
+    return slot->offset ? pmapRecordValue(p, slot->offset) : null;
+}
+
+oop pmapSet(oop map, oop key, oop value)
+{
+    pmap *p= pmapStore(map);
+    if (mapOwner && mapOwner != p->owner) runtimeError("PersistentMap: modifying a persistent map shared between parallel tasks");
+    pmapBytes k= pmapKeyBytes(key), v= pmapValueBytes(value);
+    uint64_t hash= pmapHash(&k);
+    pmapSlot *slot= pmapFind(p, &k, hash);
+    if (slot->offset) {
+        pmapRecord *r= pmapAt(p, slot->offset);
+        if (v.size <= r->capacity) {
+            memcpy((char *)(r + 1) + pmapAlign(r->keySize), pmapData(&v), v.size);
+            r->valueType= v.type;
+            r->valueSize= v.size;
+            return value;
+        }
+    }
+    else if (4 * (pmapHeaderOf(p)->count + 1) > 3 * (pmapHeaderOf(p)->mask + 1)) {
+        pmapResize(p, 2 * pmapHeaderOf(p)->mask + 1);
+        slot= pmapFind(p, &k, hash);
+    }
+    if (k.size > UINT32_MAX || v.size > UINT32_MAX) runtimeError("PersistentMap: key or value too large");
+    size_t capacity= pmapAlign(v.size > 8 ? v.size : 8);
+    uint64_t slotOffset= (char *)slot - p->base;            // the file may move
+    uint64_t offset= pmapAllocate(p, sizeof(pmapRecord) + pmapAlign(k.size) + capacity);
+    slot= pmapAt(p, slotOffset);
+    pmapRecord *r= pmapAt(p, offset);
+    *r= (pmapRecord){ k.size, capacity, v.size, k.type, v.type };
+    memcpy(r + 1, pmapData(&k), k.size);
+    memcpy((char *)(r + 1) + pmapAlign(k.size), pmapData(&v), v.size);
+    if (!slot->offset) ++pmapHeaderOf(p)->count;
+    slot->hash= hash;
+    slot->offset= offset;
+    return value;
+}
+
+size_t pmapSize(oop map)
+{
+    return pmapHeaderOf(pmapStore(map))->count;
+}
+
+// an array of the keys, or of the values, of map
+oop pmapContents(oop map, bool values)
+{
+    pmap *p= pmapStore(map);
+    pmapHeader *h= pmapHeaderOf(p);
+    oop result= makeMapCapacity(h->count);
+    struct Pair *elements= get(result, Map, elements);
+    size_t n= 0;
+    for (uint64_t i= 0;  i <= h->mask && n < h->count;  ++i) {
+        uint64_t offset= ((pmapSlot *)pmapAt(p, h->table))[i].offset;
+        if (!offset) continue;
+        elements[n].key= makeInteger(n);
+        elements[n].value= values ? pmapRecordValue(p, offset) : pmapRecordKey(p, offset);
+        ++n;
+    }
+    set(result, Map, size, n);
+    return result;
+}
+
+typedef struct pmapState
+{
+    oop    map;
+    size_t index;                   // of the next slot
+} pmapState;
+
+oop pmapEachKeyNext(oop gen)
+{
+    pmapState *s= get(gen, Generator, state);
+    pmap *p= pmapStore(s->map);
+    while (s->index <= pmapHeaderOf(p)->mask) {
+        uint64_t offset= ((pmapSlot *)pmapAt(p, pmapHeaderOf(p)->table))[s->index++].offset;
+        if (offset) return pmapRecordKey(p, offset);
+    }
+    return NULL;
+}
+
+// a generator of the keys of map, for 'for (k in map)'
+oop pmapEachKey(oop map)
+{
+    pmapState *s= malloc(sizeof(pmapState));
+    s->map= map;
+    s->index= 0;
+    return makeGenerator(pmapEachKeyNext, s);
+}
+
+// primitives
+
+oop prim_PersistentMap(oop scope, oop params)
+{
+    oop path= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(String, path)) runtimeError("PersistentMap: argument must be a file name");
+    char *name= string_value(path);
+    pmap *p= malloc(sizeof(pmap));
+    p->fd= open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (p->fd < 0 || fstat(p->fd, &st)) runtimeError("PersistentMap: %s: %s", name, strerror(errno));
+    if (flock(p->fd, LOCK_EX | LOCK_NB)) {
+        int error= errno;
+        close(p->fd);
+        runtimeError("PersistentMap: %s: %s", name, EWOULDBLOCK == error ? "already open" : strerror(error));
+    }
+    p->owner= mapOwner;
+    if (0 == st.st_size) {
+        if (ftruncate(p->fd, PMAP_INITIAL) || !pmapMap(p, PMAP_INITIAL)) {
+            int error= errno;
+            close(p->fd);
+            runtimeError("PersistentMap: %s: %s", name, strerror(error));
+        }
+        pmapHeader *h= pmapHeaderOf(p);
+        memcpy(h->magic, PMAP_MAGIC, sizeof(PMAP_MAGIC));
+        h->end= sizeof(pmapHeader);
+        pmapResize(p, PMAP_SLOTS - 1);
+    }
+    else {
+        if (st.st_size < sizeof(pmapHeader)) {
+            close(p->fd);
+            runtimeError("PersistentMap: %s: not a persistent map", name);
+        }
+        if (!pmapMap(p, st.st_size)) {
+            int error= errno;
+            close(p->fd);
+            runtimeError("PersistentMap: %s: %s", name, strerror(error));
+        }
+        pmapHeader *h= pmapHeaderOf(p);
+        if (memcmp(h->magic, PMAP_MAGIC, sizeof(PMAP_MAGIC)) || h->end > p->size
+            || h->table + sizeof(pmapSlot) * (h->mask + 1) > h->end || (h->mask & (h->mask + 1))) {
+            munmap(p->base, p->size);
+            close(p->fd);
+            runtimeError("PersistentMap: %s: not a persistent map", name);
+        }
+    }
+    oop map= makePersistentMap(clone(path), p);
+#if (USE_GC)
+    GC_register_finalizer(map, pmapFinalise, NULL, NULL, NULL);
+#endif
+    return map;
+}
+
+oop prim_sync(oop scope, oop params)
+{
+    oop map= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (!is(PersistentMap, map)) runtimeError("sync: argument must be a persistent map");
+    pmap *p= pmapStore(map);
+    if (msync(p->base, p->size, MS_SYNC)) runtimeError("sync: %s", strerror(errno));
+    return map;
+}
@@ -0,0 +1,191 @@
+/* parsing ahead, included by parse.leg
+ *
+ * When main() reaches its first input, the files named after it on the command line start
+ * being parsed on background threads, one per file, while the files before them are being
+ * evaluated.  Each thread has its own parser (a parser_t and leg context) and never looks at
+ * run-time state, since that belongs to the main thread:
+ *
+ *  - Every question it asks about whether an identifier names a syntax function (getSyntaxId)
+ *    is answered 'no', and the symbol and arity asked about are recorded with the statement.
+ *    Before evaluating a statement parsed ahead, the main thread asks those questions again,
+ *    now that the statements before it have run; if any answer has become 'yes' it parses
+ *    the file again from the start of that statement itself.
+ *
+ *  - An import, a case label that is not a literal or a syntax error ends the parse ahead of
+ *    the file at the start of that statement, from where the main thread parses the rest as
+ *    usual (and so reports the syntax error exactly as it would have otherwise).
+ *
+ * Files are evaluated in the order given, whether or not they were parsed ahead.  Only
+ * regular files (which are mapped, and so can be parsed again from any offset) are parsed
+ * ahead, and only when there is more than one processor, or '--threads N' before the first
+ * input says there are: N < 2 turns parsing ahead off and N >= 2 turns it on even with one
+ * processor (so that it can be tested anywhere).  Nothing is parsed ahead after '-c' (which
+ * reads the statements from the cache instead) or '--image', '--serve'.
+ */
+
+typedef struct preparsedStatement
+{
+    oop     ast;
+    oop     queries;    // the symbols asked about being syntax -> the arities asked (as bits)
+    size_t  offset;     // where the statement starts in the file
+    int     line, endLine;
+} preparsedStatement;
+
+DECLARE_BUFFER(preparsedStatement, PreparsedStatements);
+
+typedef struct preparse
+{
+    char                *fileName;      // the argument of main() that names the file
+    PreparsedStatements  statements;
+    bool                 complete;      // the statements are all of the file
+    size_t               offset;        // otherwise where the main thread must start parsing
+    int                  line, endLine;
+    unsigned long long   nalloc, nallocs;
+#if (USE_THREADS)
+    pthread_t            thread;
+#endif
+} preparse;
+
+preparse **preparses= NULL;     // in the order of the command line
+int        preparseCount= 0;
+int        preparseNext= 0;     // the first that has not been evaluated yet
+
+#if (USE_THREADS)
+
+void *preparseRun(void *arg)
+{
+    preparse *p= arg;
+    registerThreadLocals();
+    parser= parserNew();
+    parser->ahead= true;
+    input_t *input= inputOpen(p->fileName);
+    p->offset= 0;
+    p->line= 1;
+    if (input && 0 == input->capacity) {
+        parser->input= input;
+        for (;;) {
+            p->offset= parserOffset();
+            p->line= input->lineNumber;
+            parser->queries= makeMap();
+            parser->deferred= false;
+            if (!yyparse(parser->yy) || parser->deferred) break;
+            if (!parser->result) {
+                p->complete= true;
+                p->endLine= input->lineNumber;
+                break;
+            }
+            preparsedStatement s= { parser->result, parser->queries, p->offset, p->line, input->lineNumber };
+            PreparsedStatements_append(&p->statements, s);
+        }
+    }
+    if (input) inputClose(input);
+    p->nalloc= nalloc;
+    p->nallocs= nallocs;
+    unregisterThreadLocals();
+    return NULL;
+}
+
+#endif // USE_THREADS
+
+// start parsing ahead the files named in argv, the arguments of main() after the current one
+void preparseStart(int argc, char **argv)
+{
+#if (USE_THREADS)
+    static bool started= false;
+    int threads= parallelThreads ? parallelThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (started || opt_c || threads < 2) return;
+    started= true;
+    preparses= malloc(sizeof(preparse *) * (argc ? argc : 1));
+    for (int i= 0;  i < argc;  ++i) {
+        char *arg= argv[i];
+        if (!strcmp(arg, "-c") || !strcmp(arg, "--image") || !strcmp(arg, "--serve")) break;
+        if (!strcmp(arg, "--threads") || !strcmp(arg, "--save-image") || !strcmp(arg, "--gc")) {
+            ++i;
+            continue;
+        }
+        if (!strcmp(arg, "-g") || !strcmp(arg, "-v") || !strcmp(arg, "-")) continue;
+        preparse *p= malloc(sizeof(preparse));
+        p->fileName= arg;
+        if (pthread_create(&p->thread, NULL, preparseRun, p)) {
+            if (opt_v) perror("preparse");
+            break;
+        }
+        preparses[preparseCount++]= p;
+    }
+#endif
+}
+
+// answer whether every question that the parser answered 'no' while parsing ahead still has that answer
+bool preparseValid(oop queries)
+{
+    for (size_t i= 0;  i < map_size(queries);  ++i) {
+        struct Pair *pair= &get(queries, Map, elements)[i];
+        int_t arities= getInteger(pair->value);
+        if (((arities & 1) && null != syntaxDefinition(1, pair->key)) || ((arities & 2) && null != syntaxDefinition(2, pair->key)))
+            return false;
+    }
+    return true;
+}
+
+// evaluate the statements of p that are still valid, answering how many there were
+size_t preparseEval(oop scope, preparse *p)
+{
+    PreparsedStatements *statements= &p->statements;
+    volatile size_t i= 0;
+    jbRecPush();
+    jb_record *jtop= jbs;
+    int jbt= sigsetjmp(jbs->jb, 0);
+    if (0 == jbt) {
+        for (;  i < PreparsedStatements_position(statements);  ++i) {
+            preparsedStatement *s= &PreparsedStatements_buffer(statements)[i];
+            if (!preparseValid(s->queries)) break;
+            if (opt_v > 1) {
+                printf("%s:%i: ", p->fileName, s->endLine);
+                println(s->ast);
+            }
+            oop res= eval(scope, s->ast);
+            if (opt_v > 0) println(res);
+            assert(jbs == jtop);
+        }
+        jbRecPop();
+        return i;
+    }
+    assert(jbs == jtop);
+    oop res = jbs->result;
+    jbRecPop();
+    uncaught(jbt, res);
+    return 0;
+}
+
+// evaluate fileName, an argument of main(), using what was parsed ahead for it if anything was
+void preparseReadEvalPrint(oop scope, char *fileName)
+{
+#if (USE_THREADS)
+    if (preparseNext < preparseCount && preparses[preparseNext]->fileName == fileName) {
+        preparse *p= preparses[preparseNext++];
+        pthread_join(p->thread, NULL);
+        nalloc  += p->nalloc;
+        nallocs += p->nallocs;
+        size_t done= preparseEval(scope, p);
+        size_t offset= p->offset;
+        int line= p->line;
+        if (done < PreparsedStatements_position(&p->statements)) {
+            offset= PreparsedStatements_buffer(&p->statements)[done].offset;
+            line= PreparsedStatements_buffer(&p->statements)[done].line;
+        }
+        else if (p->complete) {
+            if (opt_v > 1) printf("%s:%i: ", fileName, p->endLine);
+            return;
+        }
+        inputStackPush(fileName);
+        if (offset) {
+            if (parser->input->capacity || offset > parser->input->size) runtimeError("%s: changed while it was being read", fileName);
+            parser->input->position= offset;
+            parser->input->lineNumber= line;
+        }
+        readEvalPrintInput(scope, NULL);
+        return;
+    }
+#endif
+    readEvalPrint(scope, fileName);
+}
@@ -0,0 +1,675 @@
+/* regular expressions, included by parse.leg
+ *
+ * Regex(pattern) compiles a pattern into a Regex.  The syntax is the usual one, on bytes: literal
+ * characters, '.' (any character but a newline), classes such as [a-z_] and [^,], the escapes
+ * \d \w \s \D \W \S \n \t \r and \ before any punctuation, groups (...) or (?:...), alternation
+ * '|', the quantifiers * + ? {m} {m,} {m,n}, and the anchors ^ and $ for the start and end of
+ * the string.  There are no back references and no captures.  A match is the leftmost one and,
+ * of those starting there, the longest.  The primitives that use a Regex (or a pattern, which
+ * is compiled first) are:
+ *
+ *  - match(re, s, from) answers the longest match of re starting at index from (0 by default) of
+ *    s, or null if there is none
+ *  - search(re, s, from) answers the indices [start, end] of the first match of re at or after
+ *    from, or null if there is none
+ *  - findAll(re, s) answers an array of every match, without overlapping
+ *  - split(s, re) (see search.c) answers the parts of s between non-empty matches
+ *
+ * Strings answered are slices of s, so their characters are not copied.
+ *
+ * A pattern is compiled into a program for a Thompson NFA (as in Pike's and Thompson's
+ * implementations) whose states are sets of instructions; a DFA is built from it lazily,
+ * one state and one transition at a time as the input needs them, and kept with the Regex so
+ * that later matches reuse it.  Each byte of input then costs one lookup in a table, and no
+ * pattern can make matching take more than linear time, as backtracking can.  Two DFAs are
+ * built: one runs the pattern forwards from a given position, to find the longest match
+ * starting there; the other runs the reversed pattern backwards over the string from its end,
+ * to find every position at which a match starts.  search() and findAll() run the second over
+ * the string once and the first from each match found.  If a DFA grows past REGEX_STATES
+ * states, further states are computed as needed but not kept.
+ *
+ * Compiled Regexes are cached by pattern, REGEX_CACHE of them, so a Regex made (or a pattern
+ * given to match()) inside a loop is compiled only the first time round.
+ */
+
+#include <ctype.h>
+
+#define REGEX_STATES    2000
+#define REGEX_CACHE     256
+#define REGEX_REPEAT    1000        // the largest count allowed in {m,n}
+#define REGEX_PROGRAM   100000      // the largest number of instructions
+
+typedef struct reNode
+{
+    enum { RE_EMPTY, RE_CLASS, RE_CAT, RE_ALT, RE_REPEAT, RE_BOL, RE_EOL } kind;
+    struct reNode *a, *b;
+    uint64_t       bits[4];         // the bytes matched by RE_CLASS
+    int            min, max;        // of RE_REPEAT, max -1 for no limit
+} reNode;
+
+typedef struct reInst
+{
+    enum { I_CLASS, I_SPLIT, I_JMP, I_BOL, I_EOL, I_MATCH } op;
+    int      x, y;                  // the targets of I_SPLIT and I_JMP
+    uint64_t bits[4];
+} reInst;
+
+typedef struct reState
+{
+    int             *pcs;           // the instructions (I_CLASS, I_EOL and I_MATCH only) that the state is in
+    int              count;
+    unsigned         hash;
+    bool             accept;        // a match ends here, unless it is the end of the input
+    bool             acceptEnd;     // a match ends here if it is the end of the input
+    bool             dead;          // no match can end after here
+    struct reState  *chain;         // in the same bucket
+    struct reState  *next[256];     // the state after each byte, NULL until needed
+} reState;
+
+#define REGEX_BUCKETS   1024
+
+typedef struct reDfa
+{
+    reInst          *prog;
+    int              size;
+    bool             unanchored;    // a match can also start at every position after the first
+    reState         *startAt;       // at the start of the input
+    reState         *startMid;      // elsewhere
+    reState         *buckets[REGEX_BUCKETS];
+    int              nstates;
+#if (USE_THREADS)
+    pthread_mutex_t  lock;          // for adding states and transitions; they are read without it
+#endif
+} reDfa;
+
+typedef struct regex
+{
+    reDfa *forward, *backward;
+} regex;
+
+// parsing a pattern
+
+typedef struct reParser
+{
+    char   *p, *end;
+    char   *error;
+} reParser;
+
+reNode *reNew(int kind, reNode *a, reNode *b)
+{
+    reNode *n= malloc(sizeof(reNode));
+    n->kind= kind;
+    n->a= a;
+    n->b= b;
+    return n;
+}
+
+void reSet(uint64_t *bits, int c)        { bits[c >> 6] |= (uint64_t)1 << (c & 63); }
+bool reHas(uint64_t *bits, int c)        { return bits[c >> 6] >> (c & 63) & 1; }
+
+// add to bits the class of an escape such as \d, answering false if c does not name one
+bool reEscapeClass(uint64_t *bits, int c)
+{
+    uint64_t set[4]= { 0 };
+    switch (tolower(c)) {
+        case 'd':   for (int i= '0';  i <= '9';  ++i) reSet(set, i);  break;
+        case 'w':   for (int i= 0;  i < 256;  ++i) if (isalnum(i) || '_' == i) reSet(set, i);  break;
+        case 's':   for (int i= 0;  i < 256;  ++i) if (isspace(i)) reSet(set, i);  break;
+        default:    return false;
+    }
+    for (int i= 0;  i < 4;  ++i) bits[i] |= isupper(c) ? ~set[i] : set[i];
+    return true;
+}
+
+int reEscapeChar(int c)
+{
+    switch (c) {
+        case 'n':   return '\n';
+        case 't':   return '\t';
+        case 'r':   return '\r';
+        default:    return c;
+    }
+}
+
+reNode *reAlternation(reParser *r);
+
+reNode *reClass(reParser *r)
+{
+    reNode *n= reNew(RE_CLASS, NULL, NULL);
+    bool negated= r->p < r->end && '^' == *r->p;
+    if (negated) ++r->p;
+    bool first= true;
+    while (r->p < r->end && (']' != *r->p || first)) {
+        first= false;
+        int c= (unsigned char)*r->p++;
+        if ('\\' == c && r->p < r->end) {
+            c= (unsigned char)*r->p++;
+            if (reEscapeClass(n->bits, c)) continue;
+            c= reEscapeChar(c);
+        }
+        int last= c;
+        if (r->p + 1 < r->end && '-' == r->p[0] && ']' != r->p[1]) {
+            ++r->p;
+            last= (unsigned char)*r->p++;
+            if ('\\' == last && r->p < r->end) last= reEscapeChar((unsigned char)*r->p++);
+            if (last < c) {
+                r->error= "invalid range in class";
+                return NULL;
+            }
+        }
+        for (int i= c;  i <= last;  ++i) reSet(n->bits, i);
+    }
+    if (r->p >= r->end) {
+        r->error= "missing ]";
+        return NULL;
+    }
+    ++r->p;
+    if (negated) for (int i= 0;  i < 4;  ++i) n->bits[i]= ~n->bits[i];
+    return n;
+}
+
+reNode *reAtom(reParser *r)
+{
+    int c= (unsigned char)*r->p++;
+    switch (c) {
+        case '(': {
+            if (r->p + 1 < r->end && '?' == r->p[0] && ':' == r->p[1]) r->p += 2;
+            reNode *n= reAlternation(r);
+            if (!n) return NULL;
+            if (r->p >= r->end || ')' != *r->p) {
+                r->error= "missing )";
+                return NULL;
+            }
+            ++r->p;
+            return n;
+        }
+        case '[':   return reClass(r);
+        case '^':   return reNew(RE_BOL, NULL, NULL);
+        case '$':   return reNew(RE_EOL, NULL, NULL);
+        case '*': case '+': case '?': case '{':
+            r->error= "nothing to repeat";
+            return NULL;
+    }
+    reNode *n= reNew(RE_CLASS, NULL, NULL);
+    if ('.' == c) {
+        for (int i= 0;  i < 256;  ++i) if ('\n' != i) reSet(n->bits, i);
+    }
+    else if ('\\' == c) {
+        if (r->p >= r->end) {
+            r->error= "trailing \\";
+            return NULL;
+        }
+        c= (unsigned char)*r->p++;
+        if (!reEscapeClass(n->bits, c)) reSet(n->bits, reEscapeChar(c));
+    }
+    else reSet(n->bits, c);
+    return n;
+}
+
+// parse the digits of a count in {m,n}, answering -1 if there are none
+int reCount(reParser *r)
+{
+    if (r->p >= r->end || !isdigit((unsigned char)*r->p)) return -1;
+    int n= 0;
+    while (r->p < r->end && isdigit((unsigned char)*r->p) && n <= REGEX_REPEAT) n= n * 10 + *r->p++ - '0';
+    return n;
+}
+
+reNode *reRepeat(reParser *r)
+{
+    reNode *n= reAtom(r);
+    while (n && r->p < r->end) {
+        int min, max;
+        switch (*r->p) {
+            case '*':   min= 0;  max= -1;  break;
+            case '+':   min= 1;  max= -1;  break;
+            case '?':   min= 0;  max=  1;  break;
+            case '{': {
+                ++r->p;
+                min= max= reCount(r);
+                if (r->p < r->end && ',' == *r->p) {
+                    ++r->p;
+                    max= reCount(r);
+                }
+                if (min < 0 || r->p >= r->end || '}' != *r->p || (max >= 0 && max < min)) {
+                    r->error= "invalid {m,n}";
+                    return NULL;
+                }
+                if (min > REGEX_REPEAT || max > REGEX_REPEAT) {
+                    r->error= "count in {m,n} too large";
+                    return NULL;
+                }
+                break;
+            }
+            default:
+                return n;
+        }
+        ++r->p;
+        n= reNew(RE_REPEAT, n, NULL);
+        n->min= min;
+        n->max= max;
+    }
+    return n;
+}
+
+reNode *reConcatenation(reParser *r)
+{
+    reNode *n= reNew(RE_EMPTY, NULL, NULL);
+    while (r->p < r->end && '|' != *r->p && ')' != *r->p) {
+        reNode *m= reRepeat(r);
+        if (!m) return NULL;
+        n= RE_EMPTY == n->kind ? m : reNew(RE_CAT, n, m);
+    }
+    return n;
+}
+
+reNode *reAlternation(reParser *r)
+{
+    reNode *n= reConcatenation(r);
+    while (n && r->p < r->end && '|' == *r->p) {
+        ++r->p;
+        reNode *m= reConcatenation(r);
+        if (!m) return NULL;
+        n= reNew(RE_ALT, n, m);
+    }
+    return n;
+}
+
+// compiling a tree into a program, forwards or (for the reversed pattern) backwards
+
+typedef struct reCompiler
+{
+    reInst *prog;
+    int     size, capacity;
+    bool    reversed;
+} reCompiler;
+
+int reEmit(reCompiler *c, int op)
+{
+    if (c->size == c->capacity) {
+        c->capacity= c->capacity ? c->capacity * 2 : 64;
+        reInst *prog= malloc(sizeof(reInst) * c->capacity);
+        if (c->size) memcpy(prog, c->prog, sizeof(reInst) * c->size);
+        c->prog= prog;
+    }
+    c->prog[c->size].op= op;
+    return c->size++;
+}
+
+bool reCompile(reCompiler *c, reNode *n)
+{
+    if (c->size > REGEX_PROGRAM) return false;
+    switch (n->kind) {
+        case RE_EMPTY:
+            return true;
+        case RE_CLASS: {
+            int i= reEmit(c, I_CLASS);
+            memcpy(c->prog[i].bits, n->bits, sizeof(n->bits));
+            return true;
+        }
+        case RE_BOL:
+            reEmit(c, c->reversed ? I_EOL : I_BOL);
+            return true;
+        case RE_EOL:
+            reEmit(c, c->reversed ? I_BOL : I_EOL);
+            return true;
+        case RE_CAT:
+            return c->reversed
+                ? reCompile(c, n->b) && reCompile(c, n->a)
+                : reCompile(c, n->a) && reCompile(c, n->b);
+        case RE_ALT: {      //      split L1, L2;  L1: a;  jmp L3;  L2: b;  L3:
+            int split= reEmit(c, I_SPLIT);
+            c->prog[split].x= c->size;
+            if (!reCompile(c, n->a)) return false;
+            int jmp= reEmit(c, I_JMP);
+            c->prog[split].y= c->size;
+            if (!reCompile(c, n->b)) return false;
+            c->prog[jmp].x= c->size;
+            return true;
+        }
+        case RE_REPEAT: {
+            for (int k= 0;  k < n->min;  ++k)
+                if (!reCompile(c, n->a)) return false;
+            if (n->max < 0) {       //      L1: split L2, L3;  L2: a;  jmp L1;  L3:
+                int split= reEmit(c, I_SPLIT);
+                c->prog[split].x= c->size;
+                if (!reCompile(c, n->a)) return false;
+                c->prog[reEmit(c, I_JMP)].x= split;
+                c->prog[split].y= c->size;
+                return true;
+            }
+            int splits[REGEX_REPEAT], count= n->max - n->min;
+            for (int k= 0;  k < count;  ++k) {      //  (split L1, end;  L1: a)*
+                splits[k]= reEmit(c, I_SPLIT);
+                c->prog[splits[k]].x= c->size;
+                if (!reCompile(c, n->a)) return false;
+            }
+            for (int k= 0;  k < count;  ++k) c->prog[splits[k]].y= c->size;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the DFA
+
+void reLock(reDfa *d)
+{
+#if (USE_THREADS)
+    pthread_mutex_lock(&d->lock);
+#endif
+}
+
+void reUnlock(reDfa *d)
+{
+#if (USE_THREADS)
+    pthread_mutex_unlock(&d->lock);
+#endif
+}
+
+// add pc and the instructions it leads to without reading a byte to the set in pcs, marking each
+// in seen; I_EOL is passed only at the end of the input, and otherwise kept in the set
+void reClosure(reDfa *d, int pc, bool atStart, bool atEnd, int *pcs, int *count, char *seen)
+{
+    while (!seen[pc]) {
+        seen[pc]= 1;
+        reInst *i= &d->prog[pc];
+        switch (i->op) {
+            case I_JMP:     pc= i->x;  continue;
+            case I_SPLIT:   reClosure(d, i->x, atStart, atEnd, pcs, count, seen);  pc= i->y;  continue;
+            case I_BOL:     if (!atStart) return;  ++pc;  continue;
+            case I_EOL:     if (atEnd) { ++pc;  continue; }  // else fall through
+            default:        pcs[(*count)++]= pc;  return;
+        }
+    }
+}
+
+// whether the instructions in pcs lead to a match at the end of the input
+bool reAcceptsAtEnd(reDfa *d, int *pcs, int count)
+{
+    int  *end= malloc(sizeof(int) * d->size), n= 0;
+    char *seen= malloc(d->size);
+    for (int k= 0;  k < count;  ++k)
+        if (I_EOL == d->prog[pcs[k]].op || I_MATCH == d->prog[pcs[k]].op) reClosure(d, pcs[k], false, true, end, &n, seen);
+    for (int k= 0;  k < n;  ++k)
+        if (I_MATCH == d->prog[end[k]].op) return true;
+    return false;
+}
+
+int reIntCompare(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+// answer the state for the set of instructions in pcs, made and kept (if there is room) if it is new
+reState *reStateFor(reDfa *d, int *pcs, int count)
+{
+    qsort(pcs, count, sizeof(int), reIntCompare);
+    unsigned hash= count;
+    for (int k= 0;  k < count;  ++k) hash= hash * 31 + pcs[k];
+    for (reState *s= d->buckets[hash % REGEX_BUCKETS];  s;  s= s->chain)
+        if (s->hash == hash && s->count == count && !memcmp(s->pcs, pcs, sizeof(int) * count)) return s;
+    reState *s= malloc(sizeof(reState));
+    s->pcs= malloc(sizeof(int) * (count ? count : 1));
+    memcpy(s->pcs, pcs, sizeof(int) * count);
+    s->count= count;
+    s->hash= hash;
+    for (int k= 0;  k < count;  ++k) s->accept |= (I_MATCH == d->prog[pcs[k]].op);
+    s->acceptEnd= reAcceptsAtEnd(d, pcs, count);
+    s->dead= (0 == count);
+    if (d->nstates < REGEX_STATES) {
+        s->chain= d->buckets[hash % REGEX_BUCKETS];
+        d->buckets[hash % REGEX_BUCKETS]= s;
+        ++d->nstates;
+    }
+    return s;
+}
+
+reState *reStart(reDfa *d, bool atStart)
+{
+    int  *pcs= malloc(sizeof(int) * d->size), count= 0;
+    char *seen= malloc(d->size);
+    reClosure(d, 0, atStart, false, pcs, &count, seen);
+    return reStateFor(d, pcs, count);
+}
+
+// answer the state after reading byte c in state s, computing it if it is not known yet
+reState *reCompute(reDfa *d, reState *s, int c)
+{
+    reState *t;
+    reLock(d);
+    if (!(t= s->next[c])) {
+        int  *pcs= malloc(sizeof(int) * d->size), count= 0;
+        char *seen= malloc(d->size);
+        for (int k= 0;  k < s->count;  ++k) {
+            reInst *i= &d->prog[s->pcs[k]];
+            if (I_CLASS == i->op && reHas(i->bits, c)) reClosure(d, s->pcs[k] + 1, false, false, pcs, &count, seen);
+        }
+        if (d->unanchored) reClosure(d, 0, false, false, pcs, &count, seen);
+        t= reStateFor(d, pcs, count);
+        if (d->nstates < REGEX_STATES) __atomic_store_n(&s->next[c], t, __ATOMIC_RELEASE);
+    }
+    reUnlock(d);
+    return t;
+}
+
+// answer the state after reading byte c in state s
+static inline reState *reNext(reDfa *d, reState *s, int c)
+{
+    reState *t= __atomic_load_n(&s->next[c], __ATOMIC_ACQUIRE);
+    return t ? t : reCompute(d, s, c);
+}
+
+reDfa *reDfaNew(reNode *tree, bool reversed)
+{
+    reCompiler c= { NULL, 0, 0, reversed };
+    if (!reCompile(&c, tree) || c.size > REGEX_PROGRAM) return NULL;
+    reEmit(&c, I_MATCH);
+    reDfa *d= malloc(sizeof(reDfa));
+    d->prog= c.prog;
+    d->size= c.size;
+    d->unanchored= reversed;
+#if (USE_THREADS)
+    pthread_mutex_init(&d->lock, NULL);
+#endif
+    d->startAt= reStart(d, true);
+    d->startMid= reStart(d, false);
+    return d;
+}
+
+// answer the end of the longest match starting at index from of h (n bytes), or -1 if there is none
+ssize_t reLongest(reDfa *d, char *h, size_t n, size_t from)
+{
+    reState *s= from ? d->startMid : d->startAt;
+    ssize_t last= -1;
+    for (size_t i= from;  ;  ++i) {
+        if (i == n) {
+            if (s->acceptEnd) last= n;
+            break;
+        }
+        if (s->accept) last= i;
+        s= reNext(d, s, (unsigned char)h[i]);
+        if (s->dead) break;
+    }
+    return last;
+}
+
+// call found(i, data) for each index of h (n bytes), from n down to from, at which a match starts
+void reStarts(reDfa *d, char *h, size_t n, size_t from, void (*found)(size_t i, void *data), void *data)
+{
+    reState *s= d->startAt;     // of the reversed pattern, at the end of h
+    for (size_t i= n;  ;  --i) {
+        if (i ? s->accept : s->acceptEnd) found(i, data);
+        if (i == from) break;
+        s= reNext(d, s, (unsigned char)h[i - 1]);
+    }
+}
+
+// compiling and caching
+
+struct
+{
+    oop              regexes[REGEX_CACHE];
+#if (USE_THREADS)
+    pthread_mutex_t  lock;
+#endif
+} regexCache= {
+    { 0 },
+#if (USE_THREADS)
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+// answer the Regex for pattern, a String, compiling it only if it is not in the cache
+oop regexCompile(oop pattern, char *name)
+{
+    char *p= get(pattern, String, value);
+    size_t size= string_size(pattern);
+    unsigned hash= size;
+    for (size_t i= 0;  i < size;  ++i) hash= hash * 31 + (unsigned char)p[i];
+    oop *slot= &regexCache.regexes[hash % REGEX_CACHE];
+#if (USE_THREADS)
+    pthread_mutex_lock(&regexCache.lock);
+#endif
+    oop re= *slot;
+#if (USE_THREADS)
+    pthread_mutex_unlock(&regexCache.lock);
+#endif
+    if (re && !oopcmp(get(re, Regex, pattern), pattern)) return re;
+    reParser r= { p, p + size, NULL };
+    reNode *tree= reAlternation(&r);
+    if (tree && r.p < r.end) r.error= "unmatched )";
+    if (r.error) runtimeError("%s: %s in %s", name, r.error, string_value(pattern));
+    regex *program= malloc(sizeof(regex));
+    program->forward= reDfaNew(tree, false);
+    program->backward= reDfaNew(tree, true);
+    if (!program->forward || !program->backward) runtimeError("%s: pattern too large", name);
+    re= makeRegex(clone(pattern), program);
+#if (USE_THREADS)
+    pthread_mutex_lock(&regexCache.lock);
+#endif
+    *slot= re;
+#if (USE_THREADS)
+    pthread_mutex_unlock(&regexCache.lock);
+#endif
+    return re;
+}
+
+// the Regex given as, or compiled from, argument index of params
+regex *regexArgument(oop params, int index, char *name)
+{
+    oop re= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+    if (is(String, re)) re= regexCompile(re, name);
+    if (!is(Regex, re)) runtimeError("%s: argument %d must be a regex or a pattern", name, index + 1);
+    return get(re, Regex, program);
+}
+
+oop regexString(oop params, int index, char *name)
+{
+    oop s= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+    if (!is(String, s)) runtimeError("%s: argument %d must be a string", name, index + 1);
+    return s;
+}
+
+size_t regexFrom(oop params, int index, oop s, char *name)
+{
+    oop from= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : makeInteger(0);
+    if (!isInteger(from) || getInteger(from) < 0 || getInteger(from) > string_size(s))
+        runtimeError("%s: start out of bounds", name);
+    return getInteger(from);
+}
+
+void regexLeftmost(size_t i, void *data)
+{
+    *(ssize_t *)data= i;        // the starts are found from right to left, so the last is leftmost
+}
+
+void regexMark(size_t i, void *data)
+{
+    ((uint8_t *)data)[i >> 3] |= 1 << (i & 7);
+}
+
+// call found(start, end, data) for each match in s, from left to right, without overlapping, and
+// but for empty ones if nonEmpty is true
+void regexEach(regex *re, oop s, bool nonEmpty, void (*found)(size_t start, size_t end, void *data), void *data)
+{
+    char *h= get(s, String, value);
+    size_t n= string_size(s);
+    uint8_t *starts= xmalloc_atomic(n / 8 + 1);
+    reStarts(re->backward, h, n, 0, regexMark, starts);
+    for (size_t i= 0;  i <= n;  ) {
+        if (!(starts[i >> 3] >> (i & 7) & 1)) {
+            if (!starts[i >> 3] && !(i & 7)) i += 8;       // skip eight positions without a start at once
+            else ++i;
+            continue;
+        }
+        ssize_t end= reLongest(re->forward, h, n, i);      assert(end >= (ssize_t)i);
+        if (end > i || !nonEmpty) found(i, end, data);
+        i= end > i ? end : i + 1;
+    }
+}
+
+oop prim_Regex(oop scope, oop params)
+{
+    oop pattern= regexString(params, 0, "Regex");
+    return regexCompile(pattern, "Regex");
+}
+
+oop prim_match(oop scope, oop params)
+{
+    regex *re= regexArgument(params, 0, "match");
+    oop s= regexString(params, 1, "match");
+    size_t from= regexFrom(params, 2, s, "match");
+    ssize_t end= reLongest(re->forward, get(s, String, value), string_size(s), from);
+    return end < 0 ? null : string_slice(s, from, end);
+}
+
+oop prim_search(oop scope, oop params)
+{
+    regex *re= regexArgument(params, 0, "search");
+    oop s= regexString(params, 1, "search");
+    size_t from= regexFrom(params, 2, s, "search");
+    ssize_t start= -1;
+    reStarts(re->backward, get(s, String, value), string_size(s), from, regexLeftmost, &start);
+    if (start < 0) return null;
+    oop result= makeMap();
+    map_append(result, makeInteger(start));
+    map_append(result, makeInteger(reLongest(re->forward, get(s, String, value), string_size(s), start)));
+    return result;
+}
+
+typedef struct regexParts
+{
+    oop    s, array;
+    size_t last;        // the end of the previous match, for split()
+} regexParts;
+
+void regexFound(size_t start, size_t end, void *data)
+{
+    regexParts *parts= data;
+    map_append(parts->array, string_slice(parts->s, start, end));
+}
+
+oop prim_findAll(oop scope, oop params)
+{
+    regex *re= regexArgument(params, 0, "findAll");
+    regexParts parts= { regexString(params, 1, "findAll"), makeMap(), 0 };
+    regexEach(re, parts.s, false, regexFound, &parts);
+    return parts.array;
+}
+
+void regexBetween(size_t start, size_t end, void *data)
+{
+    regexParts *parts= data;
+    map_append(parts->array, string_slice(parts->s, parts->last, start));
+    parts->last= end;
+}
+
+// the parts of s between the non-empty matches of re
+oop regexSplit(oop s, oop re)
+{
+    regexParts parts= { s, makeMap(), 0 };
+    regexEach(get(re, Regex, program), s, true, regexBetween, &parts);
+    map_append(parts.array, string_slice(s, parts.last, string_size(s)));
+    return parts.array;
+}
@@ -0,0 +1,181 @@
+/* the embedding API declared in sandbox.h, included by parse.leg
+ *
+ * 'make libsandbox.a' compiles parse.c with SANDBOX_LIBRARY defined, which leaves out main().
+ *
+ * Each instance has its own global scope, which is installed as 'globals' for the duration
+ * of each call.  An evaluation points errorRecovery at its own sigjmp_buf, so that
+ * runtimeError(), syntaxError() and prim_exit() jump back to it instead of exiting; the
+ * jb_record stack, backtrace and input stack are then unwound to where they were when the
+ * evaluation started and whatever lookahead the parser held is discarded.
+ *
+ * sandbox_commit() copies the (key, value) pairs of the global scope, and sandbox_reset()
+ * copies them back into the same scope, which leaves functions defined by the preloaded code
+ * closing over the right scope.  Only the bindings are restored: an object that was preloaded
+ * and then modified in place stays modified.
+ */
+
+#include "sandbox.h"
+
+struct sandbox
+{
+    oop          globals;
+    struct Pair *committed;     // the bindings of globals restored by sandbox_reset()
+    size_t       ncommitted;
+    oop          result;
+    char         error[sizeof(errorMessage)];
+};
+
+sandbox *sandbox_new(void)
+{
+    static bool initialised= false;
+    if (!initialised) {
+        initialise();
+        initialised= true;
+    }
+#if (USE_GC)
+    sandbox *sb= GC_malloc_uncollectable(sizeof(sandbox));     // the host's memory is not scanned
+#else
+    sandbox *sb= memcheck(calloc(1, sizeof(sandbox)));
+#endif
+    sb->globals= newGlobals();
+    sb->result= null;
+    sandbox_commit(sb);
+    return sb;
+}
+
+void sandbox_delete(sandbox *sb)
+{
+#if (USE_GC)
+    GC_free(sb);
+#else
+    free(sb);
+#endif
+}
+
+// evaluate text (or fileName if text is NULL) in the global scope of sb
+int sandboxRun(sandbox *sb, const char *fileName, const char *text)
+{
+    sigjmp_buf recovery, *outerRecovery= errorRecovery;
+    oop outerGlobals= globals;
+    input_t *outerInput= parser->input;
+    if (parser->input) unreadLookahead();      // called by a primitive while a file is being parsed
+    errorState state= errorStateSave();
+    globals= sb->globals;
+    errorRecovery= &recovery;
+    int status= 0;
+    if (0 == sigsetjmp(recovery, 0)) {
+        if (text) {
+            inputStackPushText("<string>", (char *)text, strlen(text));
+            sb->result= readEvalPrintInput(globals, NULL);
+        }
+        else {
+            sb->result= readEvalPrint(globals, (char *)fileName);
+        }
+        *sb->error= '\0';
+    }
+    else {
+        status= errorStatus;
+        strcpy(sb->error, status ? errorMessage : "");
+        sb->result= null;
+        errorStateRestore(&state);
+        while (parser->input != outerInput) inputClose(inputStackPop());
+        parser->yy->__pos= parser->yy->__limit= 0;
+    }
+    errorRecovery= outerRecovery;
+    globals= outerGlobals;
+    return status;
+}
+
+int sandbox_eval(sandbox *sb, const char *source)
+{
+    return sandboxRun(sb, NULL, source);
+}
+
+int sandbox_evalFile(sandbox *sb, const char *fileName)
+{
+    return sandboxRun(sb, fileName, NULL);
+}
+
+oop sandbox_result(sandbox *sb)
+{
+    return sb->result;
+}
+
+const char *sandbox_error(sandbox *sb)
+{
+    return sb->error;
+}
+
+void sandbox_commit(sandbox *sb)
+{
+    size_t size= map_size(sb->globals);
+    sb->committed= malloc(sizeof(struct Pair) * (size ? size : 1));
+    memcpy(sb->committed, get(sb->globals, Map, elements), sizeof(struct Pair) * size);
+    sb->ncommitted= size;
+}
+
+int sandbox_preload(sandbox *sb, const char *fileName)
+{
+    int status= sandbox_evalFile(sb, fileName);
+    if (!status) sandbox_commit(sb);
+    return status;
+}
+
+void sandbox_reset(sandbox *sb)
+{
+    // the scope only ever grows, so its elements still have room for the committed bindings
+    oop scope= sb->globals;                             assert(get(scope, Map, capacity) >= sb->ncommitted);
+    memcpy(get(scope, Map, elements), sb->committed, sizeof(struct Pair) * sb->ncommitted);
+    set(scope, Map, size, sb->ncommitted);
+    sb->result= null;
+    *sb->error= '\0';
+}
+
+void sandbox_define(sandbox *sb, const char *name, primitive_t function)
+{
+    oop symbol= intern((char *)name);
+    map_set(sb->globals, symbol, makeFunction(function, symbol, null, null, sb->globals, null));
+}
+
+size_t sandbox_argumentCount(oop params)
+{
+    return map_size(params);
+}
+
+oop sandbox_argument(oop params, size_t index)
+{
+    return map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+}
+
+oop sandbox_null(void)                      { return null; }
+oop sandbox_integer(long long value)        { return makeInteger(value); }
+oop sandbox_string(const char *value)       { return makeString((char *)value); }
+int sandbox_isInteger(oop obj)              { return isInteger(obj); }
+int sandbox_isString(oop obj)               { return is(String, obj); }
+char *sandbox_printString(oop obj)          { return printString(obj); }
+
+// the value of anything else is a runtime error in the evaluation that asked for it (from a
+// primitive), or 0 or NULL if the host asked for it outside an evaluation; never an exit()
+long long sandbox_integerValue(oop obj)
+{
+    if (isInteger(obj)) return getInteger(obj);
+    if (errorRecovery) runtimeError("expected an integer, got %s", printString(obj));
+    return 0;
+}
+
+const char *sandbox_stringValue(oop obj)
+{
+    if (is(String, obj)) return string_value(obj);
+    if (errorRecovery) runtimeError("expected a string, got %s", printString(obj));
+    return NULL;
+}
+
+void sandbox_raise(const char *fmt, ...)
+{
+    char message[sizeof(errorMessage)];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+    runtimeError("%s", message);
+}
@@ -0,0 +1,62 @@
+/* embedding the interpreter in a C program
+ *
+ * compile:    make libsandbox.a
+ *
+ * link:       cc -o host host.c libsandbox.a -lgc -lm -lpthread
+ *
+ * A sandbox is an interpreter instance with its own global scope.  Code evaluated in one
+ * instance cannot see the variables of another, although all of them share the interned
+ * symbols and the prototypes of AST nodes.  Runtime errors, syntax errors and calls of exit()
+ * end the current evaluation and return to the host instead of ending the program.
+ *
+ * The usual pattern is to create an instance, preload the code that every request needs,
+ * and then evaluate each request followed by sandbox_reset(), which restores the global
+ * variables to what they were after the preload without parsing or running it again.
+ *
+ * All calls must be made from the thread that created the first instance.
+ */
+
+#ifndef __sandbox_h
+#define __sandbox_h
+
+#include <stddef.h>
+
+typedef union object *oop;
+typedef oop (*primitive_t)(oop scope, oop params);
+
+typedef struct sandbox sandbox;
+
+sandbox    *sandbox_new(void);
+void        sandbox_delete(sandbox *sb);
+
+// evaluate source code or the contents of a file, answering 0 on success or the exit status
+// that the command-line interpreter would have exited with: 1 after an error (whose message
+// is then answered by sandbox_error()) or the argument of exit()
+int         sandbox_eval(sandbox *sb, const char *source);
+int         sandbox_evalFile(sandbox *sb, const char *fileName);
+oop         sandbox_result(sandbox *sb);    // the value of the last statement evaluated
+const char *sandbox_error(sandbox *sb);     // "" if the last evaluation succeeded
+
+// make the current global variables (and the code that defined them) the state that
+// sandbox_reset() restores; sandbox_preload() evaluates a file and then does this
+void        sandbox_commit(sandbox *sb);
+int         sandbox_preload(sandbox *sb, const char *fileName);
+void        sandbox_reset(sandbox *sb);
+
+// define a global function implemented in C, called with the arguments in params
+void        sandbox_define(sandbox *sb, const char *name, primitive_t function);
+
+// for use by such functions (and by the host on results)
+size_t      sandbox_argumentCount(oop params);
+oop         sandbox_argument(oop params, size_t index);    // null if there are fewer arguments
+oop         sandbox_null(void);
+oop         sandbox_integer(long long value);
+oop         sandbox_string(const char *value);
+int         sandbox_isInteger(oop obj);
+int         sandbox_isString(oop obj);
+long long   sandbox_integerValue(oop obj);  // of anything else: an error in a primitive, else 0
+const char *sandbox_stringValue(oop obj);   // of anything else: an error in a primitive, else NULL
+char       *sandbox_printString(oop obj);    // valid until the next call
+void        sandbox_raise(const char *fmt, ...);    // a runtime error: the evaluation ends
+
+#endif // __sandbox_h
@@ -0,0 +1,180 @@
+/* searching strings, included by parse.leg after typedarray.c (whose vector types it uses) and
+ * regex.c (whose Regexes split() accepts)
+ *
+ *  - indexOf(s, sub, from) and lastIndexOf(s, sub) answer where the first (from index from, 0 by
+ *    default) or last occurrence of sub is in s, or -1 if there is none
+ *  - contains(s, sub), startsWith(s, prefix) and endsWith(s, suffix) answer 1 or 0
+ *  - count(s, sub) answers how many times sub occurs in s, without overlapping
+ *  - split(s, sep) answers an array of the parts of s between occurrences of sep, or of each
+ *    character of s if sep is empty, or between matches of sep if it is a Regex (see regex.c);
+ *    the parts are slices of s, so their characters are not copied
+ *  - replace(s, old, new) answers a copy of s with every occurrence of old replaced by new
+ *
+ * A single character is looked for with memchr(), which the C library implements with SIMD
+ * instructions.  A longer string is looked for thirty-two positions at a time: the positions
+ * where both its first and its last character match are found with vector comparisons and only
+ * those are compared with memcmp(), which rules out nearly every position in ordinary text with
+ * two comparisons for all thirty-two.  (Text made of few distinct characters, such as a long run
+ * of one character looked for in a longer run of it, can still take a memcmp() per position.)
+ */
+
+typedef int64_t searchx4_t __attribute__((vector_size(TYPED_VECTOR)));   // bytex32_t seen as four words
+
+// macros rather than functions, whose vector arguments would be passed differently with AVX2
+#define searchLoad(P)   ({ bytex32_t _v;  memcpy(&_v, (P), sizeof(_v));  _v; })
+#define searchAny(M)    ({ searchx4_t _w= (searchx4_t)(M);  0 != (_w[0] | _w[1] | _w[2] | _w[3]); })
+
+// answer the index of the first occurrence of s (m > 0 characters) in h (n characters), or -1
+TYPED_KERNEL ssize_t searchForward(char *h, size_t n, char *s, size_t m)
+{
+    if (m > n) return -1;
+    if (1 == m) {
+        char *p= memchr(h, s[0], n);
+        return p ? p - h : -1;
+    }
+    bytex32_t first= (uint8_t)s[0] - (bytex32_t){ 0 }, last= (uint8_t)s[m - 1] - (bytex32_t){ 0 };
+    size_t i= 0;
+    for (;  i + m - 1 + 32 <= n;  i += 32) {
+        maskx32_t match= (searchLoad(h + i) == first) & (searchLoad(h + i + m - 1) == last);
+        if (searchAny(match))
+            for (int j= 0;  j < 32;  ++j)
+                if (match[j] && !memcmp(h + i + j + 1, s + 1, m - 2)) return i + j;
+    }
+    for (;  i + m <= n;  ++i)
+        if (h[i] == s[0] && !memcmp(h + i + 1, s + 1, m - 1)) return i;
+    return -1;
+}
+
+// answer the index of the last occurrence of s (m > 0 characters) in h (n characters), or -1
+TYPED_KERNEL ssize_t searchBackward(char *h, size_t n, char *s, size_t m)
+{
+    if (m > n) return -1;
+    bytex32_t first= (uint8_t)s[0] - (bytex32_t){ 0 }, last= (uint8_t)s[m - 1] - (bytex32_t){ 0 };
+    size_t end= n - m + 1;      // the positions not yet looked at are those before end
+    for (;  end >= 32;  end -= 32) {
+        size_t i= end - 32;
+        maskx32_t match= (searchLoad(h + i) == first) & (searchLoad(h + i + m - 1) == last);
+        if (searchAny(match))
+            for (int j= 31;  j >= 0;  --j)
+                if (match[j] && !memcmp(h + i + j, s, m)) return i + j;
+    }
+    while (end-- > 0)
+        if (h[end] == s[0] && !memcmp(h + end, s, m)) return end;
+    return -1;
+}
+
+// the number of non-overlapping occurrences of s (m > 0 characters) in h (n characters)
+size_t searchCount(char *h, size_t n, char *s, size_t m)
+{
+    size_t count= 0;
+    ssize_t i;
+    for (size_t from= 0;  (i= searchForward(h + from, n - from, s, m)) >= 0;  from += i + m) ++count;
+    return count;
+}
+
+oop searchArgument(oop params, int index, char *name)
+{
+    oop arg= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+    if (!is(String, arg)) runtimeError("%s: argument %d must be a string", name, index + 1);
+    return arg;
+}
+
+oop prim_indexOf(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "indexOf");
+    oop sub= searchArgument(params, 1, "indexOf");
+    oop from= map_hasIntegerKey(params, 2) ? get(params, Map, elements)[2].value : makeInteger(0);
+    if (!isInteger(from) || getInteger(from) < 0) runtimeError("indexOf: start must be a positive integer");
+    size_t start= getInteger(from), n= string_size(s);
+    if (start > n) return makeInteger(-1);
+    if (0 == string_size(sub)) return makeInteger(start);
+    ssize_t i= searchForward(get(s, String, value) + start, n - start, get(sub, String, value), string_size(sub));
+    return makeInteger(i < 0 ? -1 : i + start);
+}
+
+oop prim_lastIndexOf(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "lastIndexOf");
+    oop sub= searchArgument(params, 1, "lastIndexOf");
+    if (0 == string_size(sub)) return makeInteger(string_size(s));
+    return makeInteger(searchBackward(get(s, String, value), string_size(s), get(sub, String, value), string_size(sub)));
+}
+
+oop prim_contains(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "contains");
+    oop sub= searchArgument(params, 1, "contains");
+    if (0 == string_size(sub)) return makeInteger(1);
+    return makeInteger(searchForward(get(s, String, value), string_size(s), get(sub, String, value), string_size(sub)) >= 0);
+}
+
+oop prim_startsWith(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "startsWith");
+    oop prefix= searchArgument(params, 1, "startsWith");
+    size_t m= string_size(prefix);
+    return makeInteger(m <= string_size(s) && !memcmp(get(s, String, value), get(prefix, String, value), m));
+}
+
+oop prim_endsWith(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "endsWith");
+    oop suffix= searchArgument(params, 1, "endsWith");
+    size_t n= string_size(s), m= string_size(suffix);
+    return makeInteger(m <= n && !memcmp(get(s, String, value) + n - m, get(suffix, String, value), m));
+}
+
+oop prim_count(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "count");
+    oop sub= searchArgument(params, 1, "count");
+    if (0 == string_size(sub)) runtimeError("count: cannot count empty strings");
+    return makeInteger(searchCount(get(s, String, value), string_size(s), get(sub, String, value), string_size(sub)));
+}
+
+oop prim_split(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "split");
+    oop sep= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    if (is(Regex, sep)) return regexSplit(s, sep);
+    sep= searchArgument(params, 1, "split");
+    char *h= get(s, String, value), *p= get(sep, String, value);
+    size_t n= string_size(s), m= string_size(sep);
+    // count the parts first, so that the array is allocated once at its final size
+    size_t parts= m ? searchCount(h, n, p, m) + 1 : n;
+    oop array= makeMapCapacity(parts ? parts : 1);
+    struct Pair *elements= get(array, Map, elements);
+    size_t from= 0;
+    for (size_t k= 0;  k < parts;  ++k) {
+        size_t to= m ? (k < parts - 1 ? from + searchForward(h + from, n - from, p, m) : n) : from + 1;
+        elements[k].key= makeInteger(k);
+        elements[k].value= string_slice(s, from, to);
+        from= to + m;
+    }
+    set(array, Map, size, parts);
+    return array;
+}
+
+oop prim_replace(oop scope, oop params)
+{
+    oop s= searchArgument(params, 0, "replace");
+    oop old= searchArgument(params, 1, "replace");
+    oop new= searchArgument(params, 2, "replace");
+    char *h= get(s, String, value), *o= get(old, String, value), *w= get(new, String, value);
+    size_t n= string_size(s), m= string_size(old), l= string_size(new);
+    if (0 == m) runtimeError("replace: cannot replace empty strings");
+    size_t count= searchCount(h, n, o, m);
+    if (0 == count) return string_slice(s, 0, n);
+    size_t size= n - count * m + count * l;
+    char *value= malloc(size + 1), *out= value;
+    size_t from= 0;
+    for (size_t k= 0;  k < count;  ++k) {
+        size_t at= from + searchForward(h + from, n - from, o, m);
+        memcpy(out, h + from, at - from);   out += at - from;
+        memcpy(out, w, l);                  out += l;
+        from= at + m;
+    }
+    memcpy(out, h + from, n - from);
+    value[size]= '\0';
+    return makeStringFrom(value, size);
+}
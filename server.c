@@ -0,0 +1,136 @@
+/* warm fork server, included by parse.leg
+ *
+ * './parse prelude.txt ... --serve SOCKET' runs its preceding inputs and then listens on the
+ * Unix domain socket SOCKET.  Each connection is handled by a child forked from the warm
+ * interpreter, which shares the prelude's heap copy-on-write instead of rebuilding it.
+ *
+ * A client (see client.c) sends the name of the script to run, or an empty name to run
+ * whatever it sends on its standard input, together with its standard input, output and error
+ * and its working directory as SCM_RIGHTS ancillary data.  The child evaluates the script on
+ * those descriptors, in that directory, and exits; the server then writes the child's exit
+ * status (or 128 plus the number of the signal that killed it) back to the client as an int
+ * and closes the connection.
+ */
+
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+typedef struct serverChild
+{
+    pid_t pid;
+    int   connection;   // where to report the exit status of pid
+} serverChild;
+
+DECLARE_BUFFER(serverChild, ServerChildren);
+
+serverChild ServerChildren_pop(ServerChildren *sc)
+{                                                                                       assert(sc->position > 0);
+    return sc->contents[--sc->position];
+}
+
+void serverSigchld(int signal) {}   // only there to interrupt pselect()
+
+// receive the script name, standard descriptors and directory sent by the client and run the script
+void serverRun(int connection)
+{
+    char name[PATH_MAX + 1];
+    int fds[4];     // standard input, output, error and the working directory
+    union { struct cmsghdr header;  char bytes[CMSG_SPACE(sizeof(fds))]; } control;
+    struct iovec iov= { name, PATH_MAX };
+    struct msghdr msg= { .msg_iov= &iov, .msg_iovlen= 1, .msg_control= control.bytes, .msg_controllen= sizeof(control.bytes) };
+    ssize_t size= recvmsg(connection, &msg, 0);
+    struct cmsghdr *cmsg= CMSG_FIRSTHDR(&msg);
+    if (size <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) exit(2);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    name[size]= '\0';
+    close(connection);
+    for (int i= 0;  i < 3;  ++i) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (fchdir(fds[3])) {
+        perror("serve");
+        exit(2);
+    }
+    close(fds[3]);
+    readEvalPrint(globals, *name ? name : NULL);
+    exit(0);
+}
+
+void serve(char *socketName)
+{
+    struct sockaddr_un addr= { .sun_family= AF_UNIX };
+    if (strlen(socketName) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket name too long\n", socketName);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socketName);
+    unlink(socketName);
+    int listener= socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 128)) {
+        perror(socketName);
+        exit(1);
+    }
+
+    // SIGCHLD is blocked except while waiting in pselect(), so no exit can go unnoticed
+    sigset_t sigchld, unblocked;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &unblocked);
+    struct sigaction sa= { .sa_handler= serverSigchld };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (opt_v) printf("[serve: listening on %s]\n", socketName);
+    fflush(stdout);
+    fflush(stderr);
+
+    ServerChildren children= BUFFER_INITIALISER;
+    for (;;) {
+        pid_t pid;
+        int status;
+        while ((pid= waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i= 0;  i < ServerChildren_position(&children);  ++i) {
+                serverChild *child= &ServerChildren_buffer(&children)[i];
+                if (child->pid != pid) continue;
+                int code= WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                if (write(child->connection, &code, sizeof(code)) != sizeof(code) && opt_v) perror("serve");
+                close(child->connection);
+                *child= ServerChildren_pop(&children);
+                break;
+            }
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        if (pselect(listener + 1, &readable, NULL, NULL, NULL, &unblocked) < 0) {
+            if (EINTR == errno) continue;
+            perror("serve");
+            exit(1);
+        }
+        int connection= accept(listener, NULL, NULL);
+        if (connection < 0) continue;
+        switch (pid= fork()) {
+            case -1: {
+                perror("serve");
+                close(connection);
+                break;
+            }
+            case 0: {
+                close(listener);
+                for (size_t i= 0;  i < ServerChildren_position(&children);  ++i) close(ServerChildren_buffer(&children)[i].connection);
+                signal(SIGCHLD, SIG_DFL);
+                sigprocmask(SIG_SETMASK, &unblocked, NULL);
+                serverRun(connection);
+                /* NOTREACHED */
+            }
+            default: {
+                ServerChildren_append(&children, (serverChild){ pid, connection });
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,279 @@
+/* sorting arrays, included by parse.leg after parallel.c (whose thread count it uses)
+ *
+ *  - sort(array) sorts the elements of array in place into the order of the keys of a Map
+ *    (integers by value, then floats by value, then strings by their characters, ...) and
+ *    answers array
+ *  - sort(array, cmp) sorts them into the order given by cmp(a, b), a number that is negative
+ *    if a goes before b, positive if it goes after it and zero if either will do
+ *
+ * The sort is stable (elements that compare equal keep their order) and adaptive: it looks for
+ * the runs of elements that are already in order (or in reverse order), extends the short ones
+ * to SORT_RUN elements by binary insertion, and merges neighbouring runs until one is left, skipping the
+ * leading and trailing elements of a merge that are already in place.  An array already sorted
+ * (or reversed) therefore costs one pass over it.  The elements are sorted in a copy, which
+ * replaces those of the array at the end, so that an exception thrown by cmp leaves the array as
+ * it was.  cmp is called through apply() with the same Map of arguments every time, so it should
+ * not keep __arguments__.
+ *
+ * Without cmp, and when the array holds at least SORT_PARALLEL elements, the array is divided
+ * between threads (as many as parallelMap() uses), each of which sorts its part; the parts are
+ * then merged in pairs, each merge also divided between all the threads, which each make a part
+ * of its output found by a binary search of its two inputs.
+ * Elements that are all integers small enough to be tagged are compared without looking at them.
+ */
+
+#define SORT_RUN        32              // the shortest run merged
+#define SORT_PARALLEL   (1 << 17)       // the fewest elements sorted by several threads
+
+typedef struct sortOrder
+{
+    oop scope, func, args, ast;     // cmp, called with args for each comparison
+} sortOrder;
+
+#define sortTaggedLess(O, A, B)     ((intptr_t)(A) < (intptr_t)(B))
+#define sortDefaultLess(O, A, B)    (oopcmp((A), (B)) < 0)
+#define sortFunctionLess(O, A, B)   sortCall((O), (A), (B))
+
+bool sortCall(sortOrder *order, oop a, oop b)
+{
+    struct Pair *args= get(order->args, Map, elements);
+    args[0].value= a;
+    args[1].value= b;
+    oop result= apply(order->scope, globals, order->func, order->args, order->ast);
+    if (isInteger(result)) return getInteger(result) < 0;
+    if (is(Float, result)) return get(result, Float, _value) < 0;
+    runtimeError("sort: comparison function must answer a number, not %s", printString(result));
+    return false;
+}
+
+// the functions sorting elements in the order LESS(order, a, b), one set for each order
+#define DECLARE_SORT(NAME, LESS)                                                        \
+                                                                                        \
+/* the first of the n elements of v that goes after x */                                \
+size_t NAME##Upper(sortOrder *order, oop x, oop *v, size_t n)                           \
+{                                                                                       \
+    size_t lo= 0, hi= n;                                                                \
+    while (lo < hi) {                                                                   \
+        size_t mid= lo + (hi - lo) / 2;                                                 \
+        if (LESS(order, x, v[mid])) hi= mid;  else lo= mid + 1;                         \
+    }                                                                                   \
+    return lo;                                                                          \
+}                                                                                       \
+                                                                                        \
+/* the first of the n elements of v that does not go before x */                        \
+size_t NAME##Lower(sortOrder *order, oop x, oop *v, size_t n)                           \
+{                                                                                       \
+    size_t lo= 0, hi= n;                                                                \
+    while (lo < hi) {                                                                   \
+        size_t mid= lo + (hi - lo) / 2;                                                 \
+        if (LESS(order, v[mid], x)) lo= mid + 1;  else hi= mid;                         \
+    }                                                                                   \
+    return lo;                                                                          \
+}                                                                                       \
+                                                                                        \
+/* sort the n elements of v, of which the first sorted already are in order */          \
+void NAME##Insert(sortOrder *order, oop *v, size_t sorted, size_t n)                    \
+{                                                                                       \
+    for (size_t i= sorted ? sorted : 1;  i < n;  ++i) {                                 \
+        oop x= v[i];                                                                    \
+        size_t k= NAME##Upper(order, x, v, i);      /* after those equal to x */        \
+        memmove(v + k + 1, v + k, sizeof(oop) * (i - k));                               \
+        v[k]= x;                                                                        \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+/* merge the runs v[0:nl] and v[nl:nl+nr] in place, using tmp for the first */          \
+void NAME##Merge(sortOrder *order, oop *v, size_t nl, size_t nr, oop *tmp)              \
+{                                                                                       \
+    oop *right= v + nl;                                                                 \
+    if (!LESS(order, right[0], v[nl - 1])) return;      /* already in order */          \
+    size_t skip= NAME##Upper(order, right[0], v, nl);                                   \
+    v += skip;                                                                          \
+    nl -= skip;                                                                         \
+    nr= NAME##Lower(order, v[nl - 1], right, nr);       /* the rest stays where it is */ \
+    memcpy(tmp, v, sizeof(oop) * nl);                                                   \
+    size_t i= 0, j= 0;                                                                  \
+    while (i < nl && j < nr) {          /* without branches, which random data mispredicts */ \
+        bool first= LESS(order, right[j], tmp[i]);                                      \
+        *v++= first ? right[j] : tmp[i];                                                \
+        j += first;                                                                     \
+        i += !first;                                                                    \
+    }                                                                                   \
+    memcpy(v, tmp + i, sizeof(oop) * (nl - i));                                         \
+}                                                                                       \
+                                                                                        \
+/* sort the n elements of v, using tmp (as large) for merging */                        \
+void NAME##Sort(sortOrder *order, oop *v, size_t n, oop *tmp)                           \
+{                                                                                       \
+    if (n < 2) return;                                                                  \
+    size_t *runs= xmalloc_atomic(sizeof(size_t) * (n / SORT_RUN + 2)), count= 0;   /* where each run starts */ \
+    for (size_t start= 0;  start < n;  ) {                                              \
+        size_t end= start + 1;                                                          \
+        if (end < n && LESS(order, v[end], v[start])) {                                 \
+            while (end < n && LESS(order, v[end], v[end - 1])) ++end;                   \
+            for (size_t l= start, r= end - 1;  l < r;  ++l, --r) {                      \
+                oop x= v[l];  v[l]= v[r];  v[r]= x;                                     \
+            }                                                                           \
+        }                                                                               \
+        else while (end < n && !LESS(order, v[end], v[end - 1])) ++end;                 \
+        if (end - start < SORT_RUN) {                                                   \
+            size_t sorted= end - start;                                                 \
+            end= start + SORT_RUN < n ? start + SORT_RUN : n;                           \
+            NAME##Insert(order, v + start, sorted, end - start);                        \
+        }                                                                               \
+        runs[count++]= start;                                                           \
+        start= end;                                                                     \
+    }                                                                                   \
+    runs[count]= n;                                                                     \
+    while (count > 1) {                 /* merge neighbouring runs in pairs */          \
+        size_t merged= 0;                                                               \
+        for (size_t i= 0;  i < count;  i += 2) {                                        \
+            if (i + 1 < count)                                                          \
+                NAME##Merge(order, v + runs[i], runs[i + 1] - runs[i], runs[i + 2] - runs[i + 1], tmp); \
+            runs[merged++]= runs[i];                                                    \
+        }                                                                               \
+        runs[merged]= n;                                                                \
+        count= merged;                                                                  \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+/* the number of elements of l that are among the first k of l and r merged */          \
+size_t NAME##Corank(sortOrder *order, size_t k, oop *l, size_t nl, oop *r, size_t nr)   \
+{                                                                                       \
+    size_t lo= k > nr ? k - nr : 0, hi= k < nl ? k : nl;                                \
+    while (lo < hi) {                                                                   \
+        size_t i= lo + (hi - lo) / 2;                                                   \
+        if (!LESS(order, r[k - i - 1], l[i])) lo= i + 1;  else hi= i;                   \
+    }                                                                                   \
+    return lo;                                                                          \
+}                                                                                       \
+                                                                                        \
+/* merge l[0:nl] and r[0:nr] into out */                                                \
+void NAME##MergeInto(sortOrder *order, oop *l, size_t nl, oop *r, size_t nr, oop *out)  \
+{                                                                                       \
+    size_t i= 0, j= 0;                                                                  \
+    while (i < nl && j < nr) {                                                          \
+        bool first= LESS(order, r[j], l[i]);                                            \
+        *out++= first ? r[j] : l[i];                                                    \
+        j += first;                                                                     \
+        i += !first;                                                                    \
+    }                                                                                   \
+    memcpy(out, l + i, sizeof(oop) * (nl - i));                                         \
+    memcpy(out + nl - i, r + j, sizeof(oop) * (nr - j));                                \
+}
+
+DECLARE_SORT(sortTagged,   sortTaggedLess)
+DECLARE_SORT(sortDefault,  sortDefaultLess)
+DECLARE_SORT(sortFunction, sortFunctionLess)
+
+#if (USE_THREADS)
+
+typedef struct sortJob
+{
+    bool    tagged;
+    bool    merging;        // the parts of from rather than sorting them
+    oop    *from, *to;      // sorted or merged from one into the other
+    size_t  n;
+    size_t  width;          // the elements in each part (but the last)
+    int     threads;
+    int     self;
+} sortJob;
+
+void *sortWorker(void *arg)
+{
+    sortJob *job= arg;
+    size_t n= job->n, width= job->width;
+    if (!job->merging) {    // sort a part of from in place
+        size_t lo= width * job->self < n ? width * job->self : n, hi= lo + width < n ? lo + width : n;
+        if (job->tagged) sortTaggedSort (NULL, job->from + lo, hi - lo, job->to + lo);
+        else             sortDefaultSort(NULL, job->from + lo, hi - lo, job->to + lo);
+        return NULL;
+    }
+    // make the same share of the output of each merge of two parts
+    for (size_t start= 0;  start < n;  start += 2 * width) {
+        size_t middle= start + width < n ? start + width : n, end= middle + width < n ? middle + width : n;
+        oop *l= job->from + start, *r= job->from + middle;
+        size_t nl= middle - start, nr= end - middle;
+        size_t k0= (nl + nr) * job->self / job->threads, k1= (nl + nr) * (job->self + 1) / job->threads;
+        size_t i0, i1;
+        if (job->tagged) {
+            i0= sortTaggedCorank(NULL, k0, l, nl, r, nr);
+            i1= sortTaggedCorank(NULL, k1, l, nl, r, nr);
+            sortTaggedMergeInto(NULL, l + i0, i1 - i0, r + k0 - i0, (k1 - i1) - (k0 - i0), job->to + start + k0);
+        }
+        else {
+            i0= sortDefaultCorank(NULL, k0, l, nl, r, nr);
+            i1= sortDefaultCorank(NULL, k1, l, nl, r, nr);
+            sortDefaultMergeInto(NULL, l + i0, i1 - i0, r + k0 - i0, (k1 - i1) - (k0 - i0), job->to + start + k0);
+        }
+    }
+    return NULL;
+}
+
+// run sortWorker() on a copy of job for each of its threads
+void sortRun(sortJob *job)
+{
+    int threads= job->threads, started= 0;
+    pthread_t thread[threads];
+    sortJob jobs[threads];
+    for (int i= 0;  i < threads;  ++i) {
+        jobs[i]= *job;
+        jobs[i].self= i;
+    }
+    while (started < threads - 1 && !pthread_create(&thread[started], NULL, sortWorker, &jobs[started + 1])) ++started;
+    for (int i= started + 1;  i < threads;  ++i) sortWorker(&jobs[i]);     // those that could not be started
+    sortWorker(&jobs[0]);
+    for (int i= 0;  i < started;  ++i) pthread_join(thread[i], NULL);
+}
+
+// sort the n elements of v with threads threads, answering which of v and tmp they are in now
+oop *sortParallel(bool tagged, oop *v, size_t n, oop *tmp, int threads)
+{
+    sortJob job= { tagged, false, v, tmp, n, (n + threads - 1) / threads, threads, 0 };
+    sortRun(&job);
+    job.merging= true;
+    for (;  job.width < n;  job.width *= 2) {
+        sortRun(&job);
+        oop *swap= job.from;  job.from= job.to;  job.to= swap;
+    }
+    return job.from;
+}
+
+#endif
+
+oop prim_sort(oop scope, oop params)
+{
+    oop array= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    oop func=  map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    if (!is(Map, array) || !map_isArray(array)) runtimeError("sort: first argument must be an array");
+    if (null != func && !is(Function, func)) runtimeError("sort: second argument must be a function");
+    map_checkWrite(array);
+    size_t n= map_size(array);
+    if (n < 2) return array;
+    struct Pair *elements= get(array, Map, elements);
+    oop *v= malloc(sizeof(oop) * n), *tmp= malloc(sizeof(oop) * n);
+    bool tagged= (null == func);
+    for (size_t i= 0;  i < n;  ++i) {
+        v[i]= elements[i].value;
+        tagged= tagged && isTag(v[i]);
+    }
+    if (null != func) {
+        sortOrder order= { scope, func, makeMapCapacity(2), mrAST };
+        map_append(order.args, null);
+        map_append(order.args, null);
+        sortFunctionSort(&order, v, n, tmp);
+    }
+    else {
+#if (USE_THREADS)
+        int threads= parallelThreads ? parallelThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (n >= SORT_PARALLEL && threads > 1 && !mapOwner) v= sortParallel(tagged, v, n, tmp, threads);
+        else
+#endif
+        if (tagged) sortTaggedSort (NULL, v, n, tmp);
+        else        sortDefaultSort(NULL, v, n, tmp);
+    }
+    elements= get(array, Map, elements);    // in case cmp changed the array
+    n= n < map_size(array) ? n : map_size(array);
+    for (size_t i= 0;  i < n;  ++i) elements[i].value= v[i];
+    return array;
+}
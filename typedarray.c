@@ -0,0 +1,456 @@
+/* typed arrays, included by parse.leg
+ *
+ * Int64Array, Float64Array and ByteArray hold numbers unboxed, one after the other, instead of
+ * in the Pairs of a Map.  Int64Array(x), Float64Array(x) and ByteArray(x) make one from x, which
+ * is either a number of elements (all zero) or an array, a typed array or (for a ByteArray) a
+ * String to convert.  Indexing, slicing and length() work as for arrays.  The primitives that
+ * work on a whole array at a time are:
+ *
+ *  - sum(a), min(a), max(a) and dot(a, b), which answer a number (min and max answer null for
+ *    an empty array)
+ *  - fill(a, value) and copy(a, b, offset), which store value in every element of a, or the
+ *    elements of b in those of a from offset (0 by default) onwards, and answer a
+ *  - add(a, b) and mul(a, b), which answer a new array of the sums or products of the elements
+ *    of a and those of b, or b itself if it is a number
+ *  - compare(a, op, b), which answers a ByteArray holding 1 where the comparison op ("<", "<=",
+ *    "==", "!=", ">=" or ">") of an element of a with that of b (or b itself) is true and 0
+ *    elsewhere
+ *
+ * The arrays given to dot(), copy(), add(), mul() and compare() must be of the same kind, and
+ * (but for copy()) of the same length.  A float stored in an integer array is truncated, and is
+ * an error if it is NaN, infinite or out of the range of 64-bit integers.  Integer elements wrap
+ * around on overflow, those of a ByteArray modulo 256, except that sum() and dot() of a ByteArray
+ * answer the exact total.  So do sum() and dot() of an Int64Array, modulo 2^64: unlike arithmetic
+ * on Integers, which answers a BigInt when it overflows, they never answer a BigInt, keeping the
+ * loops over the elements to 64-bit vector operations.
+ *
+ * The loops are written with the compiler's vector extensions, four to thirty-two elements at
+ * a time, which the compiler turns into SSE2 instructions on x86-64 (and their equivalents on
+ * other processors, or scalar code where there are none).  With GCC on x86-64 Linux each loop is
+ * also compiled for AVX2, which is used instead on processors that have it.  Sums of floats
+ * therefore add the elements in a different order from a loop over them one at a time, and may
+ * differ from it in the last bits.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+# define TYPED_KERNEL   __attribute__((target_clones("avx2", "default")))
+#else
+# define TYPED_KERNEL
+#endif
+
+#define TYPED_VECTOR    32      // bytes per vector, the width of an AVX2 register
+
+typedef int64_t  int64x4_t   __attribute__((vector_size(TYPED_VECTOR)));
+typedef uint64_t uint64x4_t  __attribute__((vector_size(TYPED_VECTOR)));   // for arithmetic that wraps around
+typedef double   doublex4_t  __attribute__((vector_size(TYPED_VECTOR)));
+typedef uint8_t  bytex32_t   __attribute__((vector_size(TYPED_VECTOR)));
+typedef int8_t   maskx32_t   __attribute__((vector_size(TYPED_VECTOR)));   // what comparing bytex32_t answers
+typedef uint16_t shortx32_t  __attribute__((vector_size(TYPED_VECTOR * 2)));
+typedef uint32_t intx32_t    __attribute__((vector_size(TYPED_VECTOR * 4)));
+typedef int64_t  maskx4_t    __attribute__((vector_size(TYPED_VECTOR)));    // what comparing the others answers
+typedef uint8_t  bytex4_t    __attribute__((vector_size(4)));
+
+enum { compare_lt, compare_le, compare_eq, compare_ne, compare_ge, compare_gt };
+
+// unaligned loads and stores, which compile to a single instruction
+#define LOAD(V, P)      ({ V _v;  memcpy(&_v, (P), sizeof(_v));  _v; })
+#define STORE(P, V)     ({ __typeof__(V) _v= (V);  memcpy((P), &_v, sizeof(_v)); })
+
+#define SELECT(M, A, B) (((M) & (A)) | (~(M) & (B)))
+#define COMPARE(OP, A, B)                                                   \
+    ( compare_lt == (OP) ? (A) <  (B) : compare_le == (OP) ? (A) <= (B)     \
+    : compare_eq == (OP) ? (A) == (B) : compare_ne == (OP) ? (A) != (B)     \
+    : compare_ge == (OP) ? (A) >= (B) :                      (A) >  (B) )
+
+// the kernels for Int64Array and Float64Array, which differ only in the type of their elements;
+// arithmetic is done in type U (vectors UV), unsigned for integers so that overflow wraps around
+// instead of being undefined; MASKED(V) reinterprets a vector of elements as integers for SELECT()
+
+#define DECLARE_KERNELS(T, V, U, UV, L, NAME, MASKED, UNMASKED)                                 \
+                                                                                                \
+TYPED_KERNEL T NAME##_sum(T *a, size_t n)                                                       \
+{                                                                                               \
+    UV acc= { 0 }, acc2= { 0 };     /* two, so that one addition need not wait for the other */ \
+    size_t i= 0;                                                                                \
+    for (;  i + 2 * L <= n;  i += 2 * L) {                                                      \
+        acc  += (UV)LOAD(V, a + i);                                                             \
+        acc2 += (UV)LOAD(V, a + i + L);                                                         \
+    }                                                                                           \
+    for (;  i + L <= n;  i += L) acc += (UV)LOAD(V, a + i);                                     \
+    acc += acc2;                                                                                \
+    U sum= 0;                                                                                   \
+    for (int j= 0;  j < L;  ++j) sum += acc[j];                                                 \
+    for (;  i < n;  ++i) sum += (U)a[i];                                                        \
+    return (T)sum;                                                                              \
+}                                                                                               \
+                                                                                                \
+TYPED_KERNEL T NAME##_dot(T *a, T *b, size_t n)                                                 \
+{                                                                                               \
+    UV acc= { 0 }, acc2= { 0 };                                                                 \
+    size_t i= 0;                                                                                \
+    for (;  i + 2 * L <= n;  i += 2 * L) {                                                      \
+        acc  += (UV)LOAD(V, a + i) * (UV)LOAD(V, b + i);                                        \
+        acc2 += (UV)LOAD(V, a + i + L) * (UV)LOAD(V, b + i + L);                                \
+    }                                                                                           \
+    for (;  i + L <= n;  i += L) acc += (UV)LOAD(V, a + i) * (UV)LOAD(V, b + i);                \
+    acc += acc2;                                                                                \
+    U sum= 0;                                                                                   \
+    for (int j= 0;  j < L;  ++j) sum += acc[j];                                                 \
+    for (;  i < n;  ++i) sum += (U)a[i] * (U)b[i];                                              \
+    return (T)sum;                                                                              \
+}                                                                                               \
+                                                                                                \
+/* the least (or greatest) of the n > 0 elements of a */                                       \
+TYPED_KERNEL T NAME##_minmax(T *a, size_t n, bool max)                                          \
+{                                                                                               \
+    size_t i= 0;                                                                                \
+    T best= a[0];                                                                               \
+    if (n >= L) {                                                                               \
+        V acc= LOAD(V, a);                                                                      \
+        for (i= L;  i + L <= n;  i += L) {                                                      \
+            V v= LOAD(V, a + i);                                                                \
+            maskx4_t m= max ? v > acc : v < acc;                                                \
+            acc= UNMASKED(SELECT(m, MASKED(v), MASKED(acc)));                                   \
+        }                                                                                       \
+        best= acc[0];                                                                           \
+        for (int j= 1;  j < L;  ++j) if (max ? acc[j] > best : acc[j] < best) best= acc[j];     \
+    }                                                                                           \
+    for (;  i < n;  ++i) if (max ? a[i] > best : a[i] < best) best= a[i];                       \
+    return best;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* r= a + b or a * b, with b an array if it is not NULL and scalar otherwise */                 \
+TYPED_KERNEL void NAME##_arith(T *r, T *a, T *b, T scalar, size_t n, bool mul)                  \
+{                                                                                               \
+    size_t i= 0;                                                                                \
+    UV s= (U)scalar - (UV){ 0 };                                                                \
+    for (;  i + L <= n;  i += L) {                                                              \
+        UV v= (UV)LOAD(V, a + i), w= b ? (UV)LOAD(V, b + i) : s;                                \
+        STORE(r + i, (V)(mul ? v * w : v + w));                                                 \
+    }                                                                                           \
+    for (;  i < n;  ++i) {                                                                      \
+        U w= b ? (U)b[i] : (U)scalar;                                                           \
+        r[i]= (T)(mul ? (U)a[i] * w : (U)a[i] + w);                                             \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+/* r[i]= a[i] op b[i] (or scalar) as 1 or 0 */                                                  \
+TYPED_KERNEL void NAME##_compare(uint8_t *r, T *a, int op, T *b, T scalar, size_t n)            \
+{                                                                                               \
+    size_t i= 0;                                                                                \
+    V s= scalar - (V){ 0 };                                                                     \
+    for (;  i + L <= n;  i += L) {                                                              \
+        V v= LOAD(V, a + i), w= b ? LOAD(V, b + i) : s;                                         \
+        maskx4_t m= COMPARE(op, v, w);                                                          \
+        STORE(r + i, __builtin_convertvector(m & 1, bytex4_t));                                 \
+    }                                                                                           \
+    for (;  i < n;  ++i) {                                                                      \
+        T w= b ? b[i] : scalar;                                                                 \
+        r[i]= COMPARE(op, a[i], w);                                                             \
+    }                                                                                           \
+}
+
+#define MASKED_INT64(V)     (V)
+#define MASKED_DOUBLE(V)    ((maskx4_t)(V))
+#define UNMASKED_DOUBLE(V)  ((doublex4_t)(V))
+
+DECLARE_KERNELS(int64_t, int64x4_t,  uint64_t, uint64x4_t, 4, int64,  MASKED_INT64,  MASKED_INT64)
+DECLARE_KERNELS(double,  doublex4_t, double,   doublex4_t, 4, double, MASKED_DOUBLE, UNMASKED_DOUBLE)
+
+#undef DECLARE_KERNELS
+
+// the kernels for ByteArray, whose sums are widened so as not to overflow
+
+TYPED_KERNEL int64_t byte_sum(uint8_t *a, size_t n)
+{
+    int64_t sum= 0;
+    size_t i= 0;
+    while (i + 32 <= n) {
+        shortx32_t acc= { 0 };
+        for (int k= 0;  k < 256 && i + 32 <= n;  ++k, i += 32)      // 256 * 255 fits in 16 bits
+            acc += __builtin_convertvector(LOAD(bytex32_t, a + i), shortx32_t);
+        for (int j= 0;  j < 32;  ++j) sum += acc[j];
+    }
+    for (;  i < n;  ++i) sum += a[i];
+    return sum;
+}
+
+TYPED_KERNEL int64_t byte_dot(uint8_t *a, uint8_t *b, size_t n)
+{
+    int64_t sum= 0;
+    size_t i= 0;
+    while (i + 32 <= n) {
+        intx32_t acc= { 0 };
+        for (int k= 0;  k < 65536 && i + 32 <= n;  ++k, i += 32)    // 65536 * 255 * 255 fits in 32 bits
+            acc += __builtin_convertvector(LOAD(bytex32_t, a + i), intx32_t)
+                 * __builtin_convertvector(LOAD(bytex32_t, b + i), intx32_t);
+        for (int j= 0;  j < 32;  ++j) sum += acc[j];
+    }
+    for (;  i < n;  ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+TYPED_KERNEL uint8_t byte_minmax(uint8_t *a, size_t n, bool max)
+{
+    size_t i= 0;
+    uint8_t best= a[0];
+    if (n >= 32) {
+        bytex32_t acc= LOAD(bytex32_t, a);
+        for (i= 32;  i + 32 <= n;  i += 32) {
+            bytex32_t v= LOAD(bytex32_t, a + i);
+            bytex32_t m= (bytex32_t)(max ? v > acc : v < acc);
+            acc= SELECT(m, v, acc);
+        }
+        best= acc[0];
+        for (int j= 1;  j < 32;  ++j) if (max ? acc[j] > best : acc[j] < best) best= acc[j];
+    }
+    for (;  i < n;  ++i) if (max ? a[i] > best : a[i] < best) best= a[i];
+    return best;
+}
+
+TYPED_KERNEL void byte_arith(uint8_t *r, uint8_t *a, uint8_t *b, uint8_t scalar, size_t n, bool mul)
+{
+    size_t i= 0;
+    bytex32_t s= scalar - (bytex32_t){ 0 };
+    for (;  i + 32 <= n;  i += 32) {
+        bytex32_t v= LOAD(bytex32_t, a + i), w= b ? LOAD(bytex32_t, b + i) : s;
+        STORE(r + i, mul ? v * w : v + w);
+    }
+    for (;  i < n;  ++i) {
+        uint8_t w= b ? b[i] : scalar;
+        r[i]= mul ? a[i] * w : a[i] + w;
+    }
+}
+
+TYPED_KERNEL void byte_compare(uint8_t *r, uint8_t *a, int op, uint8_t *b, uint8_t scalar, size_t n)
+{
+    size_t i= 0;
+    bytex32_t s= scalar - (bytex32_t){ 0 };
+    for (;  i + 32 <= n;  i += 32) {
+        bytex32_t v= LOAD(bytex32_t, a + i), w= b ? LOAD(bytex32_t, b + i) : s;
+        maskx32_t m= COMPARE(op, v, w);
+        STORE(r + i, (bytex32_t)m & 1);
+    }
+    for (;  i < n;  ++i) {
+        uint8_t w= b ? b[i] : scalar;
+        r[i]= COMPARE(op, a[i], w);
+    }
+}
+
+#undef LOAD
+#undef STORE
+#undef SELECT
+#undef COMPARE
+
+oop typedArrayArgument(oop params, int index, char *name)
+{
+    oop array= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+    if (!isTypedArray(array)) runtimeError("%s: argument %d must be a typed array", name, index + 1);
+    return array;
+}
+
+// the second array given to a primitive, which must be the same kind as the first
+oop typedArraySecond(oop a, oop params, int index, char *name, bool sameSize)
+{
+    oop b= typedArrayArgument(params, index, name);
+    if (getType(a) != getType(b)) runtimeError("%s: arrays must be of the same kind", name);
+    if (sameSize && typedArray_size(a) != typedArray_size(b)) runtimeError("%s: arrays must be of the same length", name);
+    return b;
+}
+
+oop makeTypedArrayFrom(type_t type, oop params, char *name)
+{
+    oop arg= map_hasIntegerKey(params, 0) ? get(params, Map, elements)[0].value : null;
+    if (isInteger(arg)) {
+        if (getInteger(arg) < 0) runtimeError("%s: size must not be negative", name);
+        return makeTypedArray(type, getInteger(arg));
+    }
+    if (is(String, arg) && ByteArray == type) {
+        oop array= makeTypedArray(type, string_size(arg));
+        memcpy(typedArray_elements(array), get(arg, String, value), string_size(arg));
+        return array;
+    }
+    if (isTypedArray(arg)) {
+        size_t size= typedArray_size(arg);
+        oop array= makeTypedArray(type, size);
+        for (size_t i= 0;  i < size;  ++i)
+            if (!typedArray_set(array, i, typedArray_get(arg, i)))
+                runtimeError("%s: element %zu is not a number that the array can hold", name, i);
+        return array;
+    }
+    if (is(Map, arg) && map_isArray(arg)) {
+        size_t size= map_size(arg);
+        oop array= makeTypedArray(type, size);
+        for (size_t i= 0;  i < size;  ++i)
+            if (!typedArray_set(array, i, get(arg, Map, elements)[i].value))
+                runtimeError("%s: element %zu is not a number that the array can hold", name, i);
+        return array;
+    }
+    runtimeError("%s: argument must be a size, an array or a typed array", name);
+    return null;
+}
+
+oop prim_Int64Array(oop scope, oop params)
+{
+    return makeTypedArrayFrom(Int64Array, params, "Int64Array");
+}
+
+oop prim_Float64Array(oop scope, oop params)
+{
+    return makeTypedArrayFrom(Float64Array, params, "Float64Array");
+}
+
+oop prim_ByteArray(oop scope, oop params)
+{
+    return makeTypedArrayFrom(ByteArray, params, "ByteArray");
+}
+
+oop prim_sum(oop scope, oop params)
+{
+    oop a= typedArrayArgument(params, 0, "sum");
+    size_t n= typedArray_size(a);
+    switch (getType(a)) {
+        case Int64Array:    return makeInteger(int64_sum(get(a, Int64Array, elements), n));
+        case Float64Array:  return makeFloat(double_sum(get(a, Float64Array, elements), n));
+        default:            return makeInteger(byte_sum(get(a, ByteArray, elements), n));
+    }
+}
+
+oop typedArrayMinMax(oop params, char *name, bool max)
+{
+    oop a= typedArrayArgument(params, 0, name);
+    size_t n= typedArray_size(a);
+    if (!n) return null;
+    switch (getType(a)) {
+        case Int64Array:    return makeInteger(int64_minmax(get(a, Int64Array, elements), n, max));
+        case Float64Array:  return makeFloat(double_minmax(get(a, Float64Array, elements), n, max));
+        default:            return makeInteger(byte_minmax(get(a, ByteArray, elements), n, max));
+    }
+}
+
+oop prim_min(oop scope, oop params)
+{
+    return typedArrayMinMax(params, "min", false);
+}
+
+oop prim_max(oop scope, oop params)
+{
+    return typedArrayMinMax(params, "max", true);
+}
+
+oop prim_dot(oop scope, oop params)
+{
+    oop a= typedArrayArgument(params, 0, "dot");
+    oop b= typedArraySecond(a, params, 1, "dot", true);
+    size_t n= typedArray_size(a);
+    switch (getType(a)) {
+        case Int64Array:    return makeInteger(int64_dot(get(a, Int64Array, elements), get(b, Int64Array, elements), n));
+        case Float64Array:  return makeFloat(double_dot(get(a, Float64Array, elements), get(b, Float64Array, elements), n));
+        default:            return makeInteger(byte_dot(get(a, ByteArray, elements), get(b, ByteArray, elements), n));
+    }
+}
+
+oop prim_fill(oop scope, oop params)
+{
+    oop a= typedArrayArgument(params, 0, "fill");
+    oop value= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    size_t n= typedArray_size(a);
+    if (!n) return a;
+    if (!typedArray_set(a, 0, value)) runtimeError("fill: value must be a number that the array can hold");
+    switch (getType(a)) {
+        case Int64Array: {
+            int64_t *e= get(a, Int64Array, elements);
+            for (size_t i= 1;  i < n;  ++i) e[i]= e[0];
+            break;
+        }
+        case Float64Array: {
+            double *e= get(a, Float64Array, elements);
+            for (size_t i= 1;  i < n;  ++i) e[i]= e[0];
+            break;
+        }
+        default:
+            memset(get(a, ByteArray, elements), get(a, ByteArray, elements)[0], n);
+            break;
+    }
+    return a;
+}
+
+oop prim_copy(oop scope, oop params)
+{
+    oop a= typedArrayArgument(params, 0, "copy");
+    oop b= typedArraySecond(a, params, 1, "copy", false);
+    oop offset= map_hasIntegerKey(params, 2) ? get(params, Map, elements)[2].value : makeInteger(0);
+    if (!isInteger(offset) || getInteger(offset) < 0 || getInteger(offset) + typedArray_size(b) > typedArray_size(a))
+        runtimeError("copy: offset out of bounds");
+    size_t elementSize= typedArray_elementSize(getType(a));
+    memmove((char *)typedArray_elements(a) + getInteger(offset) * elementSize, typedArray_elements(b), typedArray_size(b) * elementSize);
+    return a;
+}
+
+// the elements of the second argument of add(), mul() or compare(), NULL if it is a number, in which case scalar is set to it
+void *typedArrayOperand(oop a, oop params, int index, char *name, oop scalar)
+{
+    oop b= map_hasIntegerKey(params, index) ? get(params, Map, elements)[index].value : null;
+    if (isTypedArray(b)) return typedArray_elements(typedArraySecond(a, params, index, name, true));
+    if (!typedArray_set(scalar, 0, b)) runtimeError("%s: argument %d must be a typed array or a number that the array can hold", name, index + 1);
+    return NULL;
+}
+
+oop typedArrayArith(oop params, char *name, bool mul)
+{
+    oop a= typedArrayArgument(params, 0, name);
+    oop scalar= makeTypedArray(getType(a), 1);
+    void *b= typedArrayOperand(a, params, 1, name, scalar);
+    size_t n= typedArray_size(a);
+    oop r= makeTypedArray(getType(a), n);
+    switch (getType(a)) {
+        case Int64Array:
+            int64_arith(get(r, Int64Array, elements), get(a, Int64Array, elements), b, get(scalar, Int64Array, elements)[0], n, mul);
+            break;
+        case Float64Array:
+            double_arith(get(r, Float64Array, elements), get(a, Float64Array, elements), b, get(scalar, Float64Array, elements)[0], n, mul);
+            break;
+        default:
+            byte_arith(get(r, ByteArray, elements), get(a, ByteArray, elements), b, get(scalar, ByteArray, elements)[0], n, mul);
+            break;
+    }
+    return r;
+}
+
+oop prim_add(oop scope, oop params)
+{
+    return typedArrayArith(params, "add", false);
+}
+
+oop prim_mul(oop scope, oop params)
+{
+    return typedArrayArith(params, "mul", true);
+}
+
+oop prim_compare(oop scope, oop params)
+{
+    static char *ops[]= { [compare_lt]= "<", [compare_le]= "<=", [compare_eq]= "==", [compare_ne]= "!=", [compare_ge]= ">=", [compare_gt]= ">" };
+    oop a= typedArrayArgument(params, 0, "compare");
+    oop name= map_hasIntegerKey(params, 1) ? get(params, Map, elements)[1].value : null;
+    int op= -1;
+    if (is(String, name))
+        for (int i= 0;  i < sizeof(ops) / sizeof(*ops);  ++i)
+            if (!strcmp(string_value(name), ops[i])) op= i;
+    if (op < 0) runtimeError("compare: operator must be one of \"<\", \"<=\", \"==\", \"!=\", \">=\" or \">\"");
+    oop scalar= makeTypedArray(getType(a), 1);
+    void *b= typedArrayOperand(a, params, 2, "compare", scalar);
+    size_t n= typedArray_size(a);
+    oop r= makeTypedArray(ByteArray, n);
+    switch (getType(a)) {
+        case Int64Array:
+            int64_compare(get(r, ByteArray, elements), get(a, Int64Array, elements), op, b, get(scalar, Int64Array, elements)[0], n);
+            break;
+        case Float64Array:
+            double_compare(get(r, ByteArray, elements), get(a, Float64Array, elements), op, b, get(scalar, Float64Array, elements)[0], n);
+            break;
+        default:
+            byte_compare(get(r, ByteArray, elements), get(a, ByteArray, elements), op, b, get(scalar, ByteArray, elements)[0], n);
+            break;
+    }
+    return r;
+}